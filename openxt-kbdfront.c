@@ -15,11 +15,29 @@
 
 #include <linux/input/mt.h>
 
+#include <linux/version.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/input.h>
+#include <linux/interrupt.h>
+#include <linux/hrtimer.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/delay.h>
+#include <linux/async.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/prefetch.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/uaccess.h>
 
 #include <asm/xen/hypervisor.h>
 
@@ -34,6 +52,10 @@
 #include <xen/platform_pci.h>
 
 #include "openxt_kbdif.h"
+#include "openxt_kbd_mirror.h"
+
+#define CREATE_TRACE_POINTS
+#include "openxt_kbdfront_trace.h"
 
 
 /**
@@ -47,532 +69,5047 @@ module_param(default_max_x, int, S_IRUGO);
 static int default_max_y = 32768;
 module_param(default_max_y, int, S_IRUGO);
 
+/**
+ * Absolute scaling: when set, our absolute axes always span the default
+ * maximums above, and positions from the backend-- which span its "width"
+ * and "height"-- are rescaled to match, so userspace never has to. The
+ * scale follows the backend's width and height as they change.
+ */
+static bool abs_scaling = false;
+module_param(abs_scaling, bool, S_IRUGO);
 
 /**
- * Data structure describing the OXT-KBD device state.
+ * Deferred drain mode: when set, the event channel IRQ handler only masks
+ * the event channel and schedules a tasklet, which drains the shared ring
+ * in batches of at most drain_budget events, and unmasks the event channel
+ * once the ring is empty. This keeps long floods of touch events out of
+ * hard-IRQ context.
  */
-struct openxt_kbd_info {
+static bool deferred_drain = false;
+module_param(deferred_drain, bool, S_IRUGO);
 
-    //The raw keyboard-- used to send key events.
-    struct input_dev *keyboard;
-    struct input_dev *relative_pointer;
+static int drain_budget = 64;
+module_param(drain_budget, int, S_IRUGO | S_IWUSR);
 
-    //The input device used to deliver any absolute events.
-    struct input_dev *absolute_pointer;
+/**
+ * Motion coalescing: when set, consecutive motion events for the same device
+ * within a single pass over the ring are merged-- relative motion is summed,
+ * and absolute motion collapses to its last position-- and delivered with a
+ * single input_sync at the end of the pass. Key events flush any pending
+ * motion first, so they're never reordered against it.
+ */
+static bool coalesce_motion = false;
+module_param(coalesce_motion, bool, S_IRUGO | S_IWUSR);
 
-    // Information about the current connection to the backend domain,
-    // including the grant reference and event channel IRQ.
-    int gref;
-    int irq;
-    struct xenkbd_page *page;
+/**
+ * Priority drain: when set, each pass over the ring first delivers the
+ * keyboard keys waiting in it, up to the first pointer button, so
+ * keystrokes never wait behind a flood of pointer or touch events.
+ * Everything else is then handled in order, with motion coalesced, and
+ * touches collected into frames that are delivered at the end of the pass.
+ * Pointer buttons stay in order with pointer motion, as they land wherever
+ * the pointer was when they happened; and with keys, which may be
+ * modifying them.
+ */
+static bool priority_drain = false;
+module_param(priority_drain, bool, S_IRUGO | S_IWUSR);
 
-    struct xenbus_device *xbdev;
-    char phys[32];
-};
+/**
+ * Maximum ring page order: the largest ring we'll offer to share with
+ * backends that support multi-page rings, as a power-of-two number of pages.
+ * Backends that don't advertise multi-page support always get a single page.
+ */
+static int max_ring_page_order = 2;
+module_param(max_ring_page_order, int, S_IRUGO);
 
-//Forward declarations.
-static int  oxtkbd_remove(struct xenbus_device *);
-static int  oxtkbd_connect_backend(struct xenbus_device *, struct openxt_kbd_info *);
-static void oxtkbd_disconnect_backend(struct openxt_kbd_info *);
+/**
+ * Max rings: the most rings we'll share with a backend that can deliver
+ * events over several. With two rings, keyboard keys get a ring of their
+ * own, so they're never queued behind a flood of pointer or touch events;
+ * and each ring gets its own event channel, which can be steered to its own
+ * vCPU.
+ */
+static int max_rings = OXT_KBD_MAX_RINGS;
+module_param(max_rings, int, S_IRUGO);
+
+/**
+ * IRQ CPUs: the vCPU that should handle each ring's event channel, in ring
+ * order, or -1 to leave a ring's event channel wherever Xen binds it. This
+ * sets the default for each new device; each device's "irq_cpu" attribute
+ * can then change it.
+ */
+static int irq_cpu[OXT_KBD_MAX_RINGS] = { [0 ... OXT_KBD_MAX_RINGS - 1] = -1 };
+module_param_array(irq_cpu, int, NULL, S_IRUGO);
 
+/**
+ * Compact events: if the backend supports it, ask it to use the compact
+ * ring format, which packs events into 16-byte slots.
+ */
+static bool compact_events = true;
+module_param(compact_events, bool, S_IRUGO);
 
 /**
- * Handler for relative motion events.
+ * Event indices: if the backend supports it, use the shared page's event
+ * indices to avoid notifying each other when the other side isn't waiting.
+ */
+static bool event_index = true;
+module_param(event_index, bool, S_IRUGO);
+
+/**
+ * Interrupt moderation: when set, an interrupt that finds only a few motion
+ * or touch events on the ring opens a moderation window rather than draining
+ * the ring immediately. The ring is drained once moderation_events events
+ * have queued, a key event arrives, or moderation_motion_us microseconds
+ * have passed-- whichever comes first.
  *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The relative motion event to be handled.
+ * If moderation_key_us is non-zero, the event channel is kept masked for the
+ * duration of the window, and the ring is checked for key events every
+ * moderation_key_us microseconds. Otherwise, the event channel stays live,
+ * so key events are always handled immediately.
+ *
+ * Each of these can be tuned at runtime via sysfs.
  */
-static void __handle_relative_motion(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event)
-{
-    //Pass the relative movement on to evdev.
-    input_report_rel(info->relative_pointer, REL_X, event->motion.rel_x);
-    input_report_rel(info->relative_pointer, REL_Y, event->motion.rel_y);
+static bool moderation = false;
+module_param(moderation, bool, S_IRUGO | S_IWUSR);
 
-    //If the event has a Z-axis motion (a scroll wheel event),
-    //send that as well.
-    if (event->motion.rel_z)
-        input_report_rel(info->relative_pointer, REL_WHEEL, -event->motion.rel_z);
+static unsigned int moderation_motion_us = 2000;
+module_param(moderation_motion_us, uint, S_IRUGO | S_IWUSR);
 
-    input_sync(info->relative_pointer);
-}
+static unsigned int moderation_key_us = 0;
+module_param(moderation_key_us, uint, S_IRUGO | S_IWUSR);
 
+static unsigned int moderation_events = 32;
+module_param(moderation_events, uint, S_IRUGO | S_IWUSR);
 
 /**
- * Handler for pure absolute (e.g. touchpad) movements.
+ * Busy polling: when set, each interrupt that's handled in hard-IRQ context
+ * starts a polling window, during which the backend is asked not to notify
+ * us, and the ring is instead checked every busy_poll_interval_us
+ * microseconds. Each event seen extends the window, which closes once the
+ * ring has been idle for busy_poll_us microseconds; we then go back to
+ * waiting for interrupts. This trades CPU time for latency, and so has no
+ * effect while moderating interrupts or deferring drains.
  *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The absolute motion event to be handled.
+ * Each of these can be tuned at runtime via sysfs.
  */
-static void __handle_absolute_motion(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event)
-{
-    //Send the new absolute coordinate...
-    input_report_abs(info->absolute_pointer, ABS_X, event->pos.abs_x);
-    input_report_abs(info->absolute_pointer, ABS_Y, event->pos.abs_y);
+static bool busy_poll = false;
+module_param(busy_poll, bool, S_IRUGO | S_IWUSR);
 
-    //... and if we have a scroll wheel event, send that too.
-    if (event->pos.rel_z)
-        input_report_rel(info->absolute_pointer, REL_WHEEL, -event->pos.rel_z);
-
-    input_sync(info->absolute_pointer);
-}
+static unsigned int busy_poll_us = 200;
+module_param(busy_poll_us, uint, S_IRUGO | S_IWUSR);
 
+static unsigned int busy_poll_interval_us = 10;
+module_param(busy_poll_interval_us, uint, S_IRUGO | S_IWUSR);
 
 /**
- * Handler for multitouch touch events.
- *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The touch event to be handled.
+ * Statistics collection: when set, each device keeps per-CPU counters
+ * describing its ring traffic, which can be read from
+ * <debugfs>/openxt-kbdfront/<device>/stats.
  */
-static void __handle_touch_down(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event)
-{
-    //Send an indication that the given finger has been pressed...
-    input_mt_slot(info->absolute_pointer, event->touch_move.id);
-    input_mt_report_slot_state(info->absolute_pointer, MT_TOOL_FINGER, 1);
-}
+static bool collect_stats = false;
+module_param(collect_stats, bool, S_IRUGO | S_IWUSR);
 
+/**
+ * Timestamps: if the backend supports it, ask it to timestamp each batch
+ * of events, so evdev reports when input actually happened rather than when
+ * we saw it. (Requires a kernel with input_set_timestamp; otherwise, the
+ * timestamps only feed our latency statistics.)
+ */
+static bool timestamps = true;
+module_param(timestamps, bool, S_IRUGO);
 
 /**
- * Handler for multitouch touch events.
- *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The touch event to be handled.
+ * Touch batches: if the backend supports it, ask it to describe each touch
+ * frame with a single batch record, which we decode in a single pass.
  */
-static void __handle_touch_movement(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event, int report_slot, int send_abs_event)
-{
-    //Send the slot number, which determines which "finger" is providing
-    //the touch event.
-    if (report_slot)
-        input_mt_slot(info->absolute_pointer, event->touch_move.id);
+static bool touch_batches = true;
+module_param(touch_batches, bool, S_IRUGO);
 
-    //... the multi-touch coordinates...
-    input_report_abs(info->absolute_pointer, ABS_MT_POSITION_X, event->touch_move.abs_x);
-    input_report_abs(info->absolute_pointer, ABS_MT_POSITION_Y, event->touch_move.abs_y);
+/**
+ * Output events: if the backend supports it, send it our keyboard's LED
+ * state and our absolute pointer's rumble effects over the shared ring.
+ * Determines the capabilities our devices are created with, so only
+ * affects devices created while it's set.
+ */
+static bool output_events = true;
+module_param(output_events, bool, S_IRUGO);
 
-    //... and absolute touch points, if desired.
-    //Note that we only send the absolute touch events for slot zero-- the other "fingers"
-    //only send multi-touch events!
-    if (send_abs_event && (event->touch_move.id == 0)) {
-        input_report_abs(info->absolute_pointer, ABS_X, event->touch_move.abs_x);
-        input_report_abs(info->absolute_pointer, ABS_Y, event->touch_move.abs_y);
-    }
-}
+/**
+ * Shared ring pages: if the backend supports it, place our ring areas in
+ * pages shared with the ring areas of other devices on the same backend,
+ * rather than giving each ring a page of its own. Saves memory when there
+ * are many devices, at the cost of a smaller ring. Ignored if we'd use a
+ * multi-page ring.
+ */
+static bool share_ring_pages = false;
+module_param(share_ring_pages, bool, S_IRUGO);
 
+/**
+ * Touch deduplication: when set, touch events are collected into per-contact
+ * state, and only the differences between one touch frame and the next are
+ * delivered to evdev-- so several movements of a contact within a single
+ * frame produce only a single report. A change takes effect at the next
+ * frame boundary, and lifts any contacts still touching; the same goes for
+ * priority_drain, which implies it.
+ */
+static bool touch_dedupe = false;
+module_param(touch_dedupe, bool, S_IRUGO | S_IWUSR);
 
 /**
- * Handler for multitouch touch events.
- *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The touch event to be handled.
+ * Touch slots: the number of touch contacts the absolute pointer can track
+ * at once, for backends that don't specify a "max-contacts" value.
  */
-static void __handle_touch_up(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event)
-{
-    //Send an indication that the given finger has been pressed...
-    input_mt_slot(info->absolute_pointer, event->touch_move.id);
-    input_mt_report_slot_state(info->absolute_pointer, MT_TOOL_FINGER, 0);
-}
+static int touch_slots = 10;
+module_param(touch_slots, int, S_IRUGO);
 
+/**
+ * Motion scale: the factor by which relative pointer motion is scaled, in
+ * units of 1/256; so 256 passes motion through unchanged, and 64 reduces a
+ * high-DPI mouse's motion to a quarter. Fractional motion is carried over
+ * to later events, so no precision is lost, and motion that doesn't add up
+ * to a whole unit isn't reported at all.
+ */
+static int motion_scale = 256;
+module_param(motion_scale, int, S_IRUGO | S_IWUSR);
 
 /**
- * Handle touch framing events.
- *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The touch event to be handled.
+ * Fast resume: when set, resuming from S3 keeps the ring area and the
+ * parameters negotiated with the backend, resetting only the ring indices
+ * before granting the ring back out and binding a new event channel. This
+ * assumes the backend's features haven't changed while we were asleep.
  */
-static void __handle_touch_framing(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event)
-{
-    input_mt_sync_frame(info->absolute_pointer);
-    input_sync(info->absolute_pointer);;
-}
+static bool fast_resume = false;
+module_param(fast_resume, bool, S_IRUGO | S_IWUSR);
 
 /**
- * Handler for keypress events, including mouse button "keys".
- *
- * @param info The device information structure for the relevant PV input
- *      device.
- * @param event The keypress event to be handled.
+ * Kernel contact tracking: when set, the input core's slot lookup is used to
+ * map the backend's contact identifiers onto touch slots, rather than our own
+ * lookup table. Not used while deduplicating touches, as the input core only
+ * sees contacts once they're reported.
  */
-static void __handle_key_or_button_press(struct openxt_kbd_info *info,
-        union oxtkbd_in_event *event)
-{
-    struct input_dev *dev = NULL;
+static bool mt_kernel_tracking = false;
+module_param(mt_kernel_tracking, bool, S_IRUGO);
 
-    //If this event is corresponds to a keyboard event,
-    //send it via the keyboard device.
-    if (test_bit(event->key.keycode, info->keyboard->keybit))
-        dev = info->keyboard;
+/**
+ * Keymap profile: the set of keys the keyboard device registers. One of
+ * "full" (every key the input core knows), "pc105" (a standard 105-key
+ * layout), or "pc105-media" (the same, plus common media keys). If set to
+ * "auto", the backend's "keymap-profile" is used, or "full" if it has none.
+ * Smaller keymaps make the keyboard cheaper for userspace to probe.
+ */
+static char *keymap = "auto";
+module_param(keymap, charp, S_IRUGO);
 
-    //If it corresponds to a mouse event, send it via the mouse
-    //device. TODO: Possibly differentiate between ABS and REL presses?
-    if (test_bit(event->key.keycode, info->relative_pointer->keybit))
-        dev = info->relative_pointer;
+/**
+ * Input mirror: when set, each device also provides /dev/oxtkbd-<device>,
+ * through which a trusted consumer, such as a compositor, can map a
+ * read-only mirror of the device's decoded input; see openxt_kbd_mirror.h.
+ * Evdev still receives every event. mirror_events sets the number of
+ * records in each device's mirror, which is rounded up to a power of two.
+ */
+static bool input_mirror = false;
+module_param(input_mirror, bool, S_IRUGO);
 
-    //If we found a device to send the key via, send it!
-    if (dev) {
-        input_report_key(dev, event->key.keycode, event->key.pressed);
-        input_sync(dev);
-    }
-    else {
-        pr_warning("unhandled keycode 0x%x\n", event->key.keycode);
-    }
-}
+static int mirror_events = 4096;
+module_param(mirror_events, int, S_IRUGO);
 
 
 /**
- * Main handler for OpenXT PV input.
+ * Destinations for key events, as stored in the key routing table.
  */
-static irqreturn_t input_handler(int rq, void *dev_id)
-{
-    __u32 cons, prod;
+enum oxtkbd_key_route {
+    OXT_KBD_ROUTE_NONE     = 0,
+    OXT_KBD_ROUTE_KEYBOARD = 1,
+    OXT_KBD_ROUTE_POINTER  = 2,
+};
 
-    //Get a reference to the device's information structure...
-    struct openxt_kbd_info *info = dev_id;
+//Each route takes two bits, so the whole routing table fits in a
+//handful of cache lines.
+#define OXT_KBD_ROUTE_BITS       2
+#define OXT_KBD_ROUTES_PER_BYTE  (8 / OXT_KBD_ROUTE_BITS)
+#define OXT_KBD_ROUTE_MASK       ((1 << OXT_KBD_ROUTE_BITS) - 1)
 
-    //... and get a reference to the shared page used for communications.
-    struct xenkbd_page *page = info->page;
 
-    //If we have the latest data from the ringbuffer, we're done!
-    prod = page->in_prod;
-    if (prod == page->in_cons)
-        return IRQ_HANDLED;
+//The number of buckets in each of our log2 histograms; bucket zero counts
+//zero values, and bucket n counts values in [2^(n-1), 2^n).
+#define OXT_KBD_HIST_BUCKETS     24
 
-    //Ensure that we always see the latest data.
-    rmb();
+//The length of each of the windows over which we estimate the offset
+//between the backend's clock and our own.
+#define OXT_KBD_CLOCK_WINDOW_NS  (10 * NSEC_PER_SEC)
 
-    //For each outstanding event in the ringbuffer...
-    for (cons = page->in_cons; cons != prod; cons++) {
-        union oxtkbd_in_event *event;
+//The most touch contacts our absolute pointer can track at once.
+#define OXT_KBD_MAX_TOUCH_SLOTS  64
 
-        //Get a reference to the current event.
-        event = &OXT_KBD_IN_RING_REF(page, cons);
+//The maximum number of passes over the ring we'll make from hard-IRQ
+//context before handing the rest of the work off to our tasklet.
+#define OXT_KBD_MAX_IRQ_PASSES   4
 
-        switch (event->type) {
+//The distance ahead of in_cons we move in_prod_event while busy polling.
+//The backend would have to produce this many events before notifying us,
+//which can't happen on any ring we can share; so it never does.
+#define OXT_KBD_POLL_EVENT_OFFSET  0x80000000U
 
-        case OXT_KBD_TYPE_MOTION:
-            __handle_relative_motion(info, event);
-            break;
+//The number of fractional bits in our fixed-point motion scale.
+#define OXT_KBD_MOTION_SCALE_SHIFT  8
+#define OXT_KBD_MOTION_SCALE_ONE    (1 << OXT_KBD_MOTION_SCALE_SHIFT)
 
-        case OXT_KBD_TYPE_KEY:
-            __handle_key_or_button_press(info, event);
-            break;
+//The number of fractional bits in the absolute scale factors.
+#define OXT_KBD_ABS_SCALE_SHIFT     16
+#define OXT_KBD_ABS_SCALE_ONE       (1 << OXT_KBD_ABS_SCALE_SHIFT)
 
-        case OXT_KBD_TYPE_POS:
-            __handle_absolute_motion(info, event);
-            break;
+//The bounds, in milliseconds, of the delay between retries of a xenstore
+//transaction that conflicted with another.
+#define OXT_KBD_MIN_BACKOFF_MS   1
+#define OXT_KBD_MAX_BACKOFF_MS   64
 
-        case OXT_KBD_TYPE_TOUCH_DOWN:
-            __handle_touch_down(info, event);
-            __handle_touch_movement(info, event, false, false);
-              break;
+//How long we wait before retrying output that didn't fit in the out ring.
+#define OXT_KBD_OUTPUT_RETRY_MS  20
 
-        case OXT_KBD_TYPE_TOUCH_UP:
-            __handle_touch_up(info, event);
-            break;
+//The kinds of output state that can be waiting to be sent to the backend.
+enum oxtkbd_output_kind {
+    OXT_KBD_OUTPUT_LEDS,
+    OXT_KBD_OUTPUT_RUMBLE,
+    OXT_KBD_OUTPUT_KINDS,
+};
 
-        case OXT_KBD_TYPE_TOUCH_MOVE:
-            __handle_touch_movement(info, event, true, false);
-            break;
+//The number of event types we keep individual counts for. Any type beyond
+//these is one we don't know how to handle.
+#define OXT_KBD_STAT_TYPES       16
 
-        case OXT_KBD_TYPE_TOUCH_FRAME:
-            __handle_touch_framing(info, event);
-            break;
 
-        }
-    }
+/**
+ * Per-CPU statistics describing a device's ring traffic.
+ * Consists solely of u64 counters, so it can be summed as an array.
+ */
+struct oxtkbd_stats {
+    u64 interrupts;
+    u64 passes;
+
+    //Busy polling windows opened, and the polls that found events waiting.
+    u64 poll_windows;
+    u64 productive_polls;
+
+    //Keyboard keys delivered ahead of the events before them.
+    u64 prioritized_keys;
+
+    //Output events sent to the backend, and the batches they were sent in.
+    u64 output_events;
+    u64 output_batches;
+    u64 events;
+    u64 unknown_events;
+    u64 unknown_keycodes;
+    u64 unmapped_contacts;
+    u64 undeliverable_events;
+    u64 events_by_type[OXT_KBD_STAT_TYPES];
+
+    //Ring overruns, and the events lost or discarded because of them.
+    u64 overruns;
+    u64 dropped_events;
+
+    //Histograms of events handled per pass, pass duration (in ns),
+    //and ring occupancy at the start of each pass.
+    u64 events_per_pass[OXT_KBD_HIST_BUCKETS];
+    u64 pass_duration[OXT_KBD_HIST_BUCKETS];
+    u64 occupancy[OXT_KBD_HIST_BUCKETS];
+
+    //Histogram of the delay (in ns) between input occurring in the backend
+    //and our handling it, beyond the smallest delay recently seen. Only
+    //populated when the backend provides timestamps.
+    u64 latency[OXT_KBD_HIST_BUCKETS];
+};
 
-    //Free the relevant space in the ringbuffer...
-    mb();
-    page->in_cons = cons;
+//Bumps a statistics counter, if we're collecting statistics.
+#define oxtkbd_stat_add(info, field, val)                   \
+    do {                                                    \
+        if (collect_stats)                                  \
+            this_cpu_add((info)->stats->field, (val));      \
+    } while (0)
+#define oxtkbd_stat_inc(info, field) oxtkbd_stat_add(info, field, 1)
 
-    //... and signal to the other side that we're ready
-    //for more data.
-    notify_remote_via_irq(info->irq);
-    return IRQ_HANDLED;
-}
 
 /**
- * Registers a new Xen Virtual Keyboard Device.
+ * Returns the log2 histogram bucket that a given value falls into.
  *
- * @param info The information structure for the combined input device
- *      for which this device should belong to.
- * @param name The new device's name, as reported to the user.
+ * @param value The value to be counted.
  */
-static struct input_dev * __allocate_keyboard_device(struct openxt_kbd_info *info,
-        char * name)
+static inline unsigned int __hist_bucket(u64 value)
 {
-    int i, ret;
-
-    //Allocate a new input device.
-    struct input_dev *kbd = input_allocate_device();
-    if (!kbd)
-        return NULL;
-
-    //Initailize its basic device information...
-    kbd->name       = name;
-    kbd->phys       = info->phys;
-    kbd->id.bustype = BUS_PCI;
-    kbd->id.vendor  = 0x5853;
-    kbd->id.product = 0xffff;
+    if (!value)
+        return 0;
 
-    //Register all of the keys we'll want the keyboard device to handle.
-    __set_bit(EV_KEY, kbd->evbit);
-    for (i = KEY_ESC; i < KEY_UNKNOWN; i++)
-        __set_bit(i, kbd->keybit);
-    for (i = KEY_OK; i < KEY_MAX; i++)
-        __set_bit(i, kbd->keybit);
-
-    //And finally, register the device with the input subsystem.
-    ret = input_register_device(kbd);
-    if (ret) {
-        input_free_device(kbd);
-        return NULL;
-    }
-
-    return kbd;
+    return min_t(unsigned int, ilog2(value) + 1, OXT_KBD_HIST_BUCKETS - 1);
 }
 
+
 /**
- * Creates a new Xen Virtrual Pointer Device.
- *
- * @param info The information structure for the combined input device
- *      for which this device should belong to.
- * @param name The new device's name, as reported to the user.
+ * The state of a single touch contact, as collected between touch frames,
+ * and as last reported to evdev.
  */
-static struct input_dev * __allocate_pointer_device(struct openxt_kbd_info *info,
-        char * name, int is_absolute, int is_multitouch)
-{
-    int i, ret;
-    struct input_dev *ptr = input_allocate_device();
+struct oxtkbd_touch_slot {
+    bool dirty;
+    s32 id;
 
-    //If we weren't able to allocate a new input device, fail out!
-    if (!ptr)
-        return NULL;
+    bool down;
+    int x, y;
 
-    //Otherwise, set up some of the device's defaults.
-    ptr->name       = name;
-    ptr->phys       = info->phys;
-    ptr->id.bustype = BUS_PCI;
-    ptr->id.vendor  = 0x5853;
-    ptr->id.product = 0xfffe;
+    bool reported_down;
+    int reported_x, reported_y;
+};
 
-    //If we're creating an absolute device, register it as a provider
-    //of absolute events.
-    if (is_absolute) {
-        __set_bit(EV_ABS, ptr->evbit);
-        input_set_abs_params(ptr, ABS_X, 0, default_max_x, 0, 0);
-        input_set_abs_params(ptr, ABS_Y, 0, default_max_y, 0, 0);
 
-        if (is_multitouch) {
-            input_set_abs_params(ptr, ABS_MT_POSITION_X, 0, default_max_x, 0, 0);
-            input_set_abs_params(ptr, ABS_MT_POSITION_Y, 0, default_max_y, 0, 0);
+/**
+ * An entry in the table mapping the backend's contact identifiers onto
+ * touch slots.
+ */
+struct oxtkbd_contact {
+    s32 id;
+    s16 slot;   //or -1, if this entry is unused
+};
 
-            //Accept touches, as well.
-            input_set_capability(ptr, EV_KEY, BTN_TOUCH);
 
-            //And allow up to ten fingers of touch.
-            input_mt_init_slots(ptr, 10, INPUT_MT_DIRECT);
-        }
-    }
-    //Otherwise, register it as providing relative ones.
-    else {
-        input_set_capability(ptr, EV_REL, REL_X);
-        input_set_capability(ptr, EV_REL, REL_Y);
-    }
+/**
+ * The features and parameters advertised by the backend, read from the
+ * XenStore together so each is only read once per connection.
+ */
+struct oxtkbd_backend_features {
+    int max_ring_page_order;    //or -1, if not advertised
+    int max_rings;              //or 1, if not advertised
+    int max_contacts;           //or 0, if not advertised
+    int width, height;          //or -1, if not advertised; these follow
+                                //the backend, under the pointer ring's lock
+
+    //Which devices the backend will drive. Legacy backends don't say, and
+    //drive all of them; so the first two are -1 if not advertised.
+    int abs_pointer;
+    int multi_touch;
+
+    //The keymap profile the backend would like, or an empty string.
+    char keymap[16];
+    bool disable_keyboard;
+    bool disable_pointer;
+
+    bool compact_events;
+    bool event_index;
+    bool timestamps;
+    bool touch_batches;
+    bool output_events;
+    bool ring_offset;
+};
 
-    //Enable scroll events on non-multitouch displays.
-    if (!is_multitouch)
-        input_set_capability(ptr, EV_REL, REL_WHEEL);
 
-    //Mark this device as providing the typical mouse keys.
-    if (!is_multitouch) {
-        __set_bit(EV_KEY, ptr->evbit);
+/**
+ * The state of a single ring shared with the backend, and of the pass
+ * over its events currently being handled. Each ring has its own event
+ * channel, and may be handled concurrently with the others.
+ */
+struct oxtkbd_ring {
 
-    for (i = BTN_LEFT; i <= BTN_TASK; i++)
-        __set_bit(i, ptr->keybit);
-  }
+    //State used on every pass over the ring, which we keep together at the
+    //start of the ring, apart from the setup state below.
+    struct openxt_kbd_info *info;
+    struct oxtkbd_page *page;
+    unsigned int index;
+    int irq;
 
-    //Finally, register the new input device with evdev.
-    ret = input_register_device(ptr);
-    if (ret) {
-        input_free_device(ptr);
-        return NULL;
-    }
+    //Serializes everything that drains the ring, or changes its moderation
+    //or polling state: our IRQ handler, tasklet and timers. Our event
+    //channel can move between vCPUs at any time-- whether we move it, or
+    //irqbalance does-- so these can otherwise run concurrently, on
+    //different CPUs.
+    spinlock_t lock;
+
+    //The index of the event currently being handled, during a pass over
+    //the ring.
+    __u32 cursor;
+
+    //True iff the record at the head of the ring hasn't been fully
+    //produced yet, in which case we wait for in_prod to reach
+    //incomplete_until before we look at the ring again.
+    bool incomplete;
+    __u32 incomplete_until;
+
+    //Which events we'll accept on this ring. With a single ring, that's all
+    //of them.
+    bool keyboard_events;
+    bool pointer_events;
+
+    //True iff this is the benchmark's ring, whose events are decoded as
+    //usual, but then delivered nowhere; see __input_event.
+    bool bench;
+
+    //True iff we're in a moderation window, or a busy polling window. See
+    //the cold state below.
+    bool moderating;
+    bool polling;
+
+    //True iff we're coalescing motion during the current pass; iff
+    //keyboard keys were delivered ahead of this pass; and iff a touch frame
+    //has ended, but is being held until the end of the pass.
+    bool coalescing;
+    bool prioritizing;
+    bool frame_pending;
+
+    //True iff event_time holds the time, on our clock, at which the events
+    //we're currently handling occurred.
+    bool have_event_time;
+    ktime_t event_time;
+
+    //The number of packets we've completed via input_sync. Kept regardless
+    //of collect_stats, as it's cheap, and the benchmark relies on it.
+    u64 syncs;
+
+    //Motion that has been accumulated, but not yet delivered, during the
+    //current pass over the ring. Only used when coalescing motion.
+    struct {
+        bool rel_pending;
+        int rel_x, rel_y, rel_z;
+
+        bool abs_pending;
+        int abs_x, abs_y, abs_z;
+    } pending;
+
+    //Timestamp state. event_time is estimated using the smallest offsets
+    //between our clock and the backend's seen in the current and previous
+    //windows.
+    ktime_t clock_window_start;
+    s64 clock_offset;
+    s64 prev_clock_offset;
+
+    //Everything below is only used when setting up or tearing down the ring,
+    //or when opening and closing moderation or polling windows.
+
+    //The grant references for each page of our shared ring area.
+    int gref[OXT_KBD_MAX_RING_PAGES] ____cacheline_aligned_in_smp;
+
+    //The vCPU that should handle our event channel, or -1 for any. Kept
+    //across reconnects, so it survives resume.
+    int cpu;
+
+    //Tasklet used to drain the ring outside of hard-IRQ context,
+    //when deferred_drain is set.
+    struct tasklet_struct drain_tasklet;
+
+    //Interrupt moderation state, protected by our lock.
+    struct hrtimer moderation_timer;
+    ktime_t moderation_deadline;
+    bool moderation_masked;
+
+    //Busy polling state, protected by our lock. If the backend doesn't
+    //support event indices, the only way to stop its notifications is to
+    //mask our event channel while we poll.
+    struct hrtimer poll_timer;
+    ktime_t poll_deadline;
+    bool poll_masked;
+
+} ____cacheline_aligned_in_smp;
 
-    return ptr;
-}
 
 /**
- * Creates a new OpenXT combined input device, if possible.
- *
- * @param dev The XenBus device to which the new combined input device will belong.
- * @param id Information regarding the relevant xenbus device.
- *
- * @return 0 on success, or an error code on failure.
+ * A device's input mirror: a shared area, mapped by its readers, into which
+ * our input handler copies each of the device's decoded events. Outlives the
+ * device for as long as anyone has it open.
  */
-static int oxtkbd_probe(struct xenbus_device *dev, const struct xenbus_device_id *id)
-{
-    int ret;
+struct oxtkbd_mirror {
+    struct kref ref;
     struct openxt_kbd_info *info;
 
-    //Create a new information structure for our new combined input device.
-    //This will represent the device "object", and store all of the device's
-    //state.
-    info = kzalloc(sizeof(*info), GFP_KERNEL);
-    if (!info) {
-        xenbus_dev_fatal(dev, -ENOMEM, "allocating info structure");
-        return -ENOMEM;
-    }
+    //The character device readers open, and its name.
+    struct miscdevice misc;
+    char name[32];
 
-    //Associate the new information structure with the core XenBus device.
-    dev_set_drvdata(&dev->dev, info);
+    //The input handler that feeds the mirror from our devices.
+    struct input_handler handler;
 
-    //Initialize the information structure.
-    info->xbdev = dev;
-    info->irq   = -1;
-    info->gref  = -1;
-    snprintf(info->phys, sizeof(info->phys), "xenbus/%s", dev->nodename);
+    //The shared area: a header, followed by a ring of records.
+    struct oxtkbd_mirror_header *shared;
+    struct oxtkbd_mirror_event *events;
+    size_t shared_size;
 
-    //To communicate with the backend, we'll use a small "shared page"
-    //as a ring buffer. We'll allocate that page now, and share it with
-    //the when it tries to connect.
-    info->page = (void *)__get_free_page(GFP_KERNEL | __GFP_ZERO);
-    if (!info->page)
+    //Serializes writers; our devices may deliver events concurrently, from
+    //different rings.
+    spinlock_t lock;
+
+    //Readers waiting for new records, and whether the device has gone away.
+    wait_queue_head_t wait;
+    bool dead;
+};
+
+
+/**
+ * The state of a single opening of a device's input mirror.
+ */
+struct oxtkbd_mirror_reader {
+    struct oxtkbd_mirror *mirror;
+
+    //The value of prod the reader last saw.
+    u32 seen;
+};
+
+
+/**
+ * Data structure describing the OXT-KBD device state.
+ */
+struct openxt_kbd_info {
+
+    //State read on every event, which we keep together in the structure's
+    //first cache line. Everything after the rings is only touched by
+    //particular kinds of event, or outside of the event path entirely.
+
+    //The raw keyboard-- used to send key events.
+    struct input_dev *keyboard;
+    struct input_dev *relative_pointer;
+
+    //The input device used to deliver any absolute events.
+    struct input_dev *absolute_pointer;
+
+    //The pointer device that most recently reported motion; pointer
+    //buttons are delivered via this device.
+    struct input_dev *last_pointer;
+
+    //Our statistics, if we're collecting them.
+    struct oxtkbd_stats __percpu *stats;
+
+    //The size of each slot in our in rings, the number of slots, and where
+    //the in ring starts within each ring area.
+    unsigned int slot_size;
+    unsigned int ring_len;
+    unsigned int in_ring_offs;
+
+    //True iff we've negotiated the use of the shared page's event indices.
+    bool event_index;
+
+    //Touch contact state, collected between touch frames when
+    //deduplicating touches. We only start or stop deduplicating at a frame
+    //boundary, so a frame is never split between the two modes.
+    bool deduplicating_touches;
+
+    //True iff we've asked the backend to timestamp its events.
+    bool timestamps;
+
+    //True iff we've asked the backend for touch batches.
+    bool touch_batches;
+
+    //The factors by which absolute positions are scaled, when abs_scaling
+    //is set, in units of 1/OXT_KBD_ABS_SCALE_ONE: X in the upper 32 bits,
+    //and Y in the lower. Protected, with the rest of our geometry, by the
+    //pointer ring's lock.
+    u64 abs_scale;
+
+    //The rings we share with the backend, of which ring_count are in use.
+    //Each starts on a cache line of its own.
+    struct oxtkbd_ring rings[OXT_KBD_MAX_RINGS];
+    unsigned int ring_count;
+
+    //Routing table mapping each keycode to the device that delivers it.
+    //Built once at probe time, from the devices' capabilities.
+    u8 key_route[DIV_ROUND_UP(KEY_CNT, OXT_KBD_ROUTES_PER_BYTE)];
+
+    //Touch contact state: our touch slots, and a mapping from the
+    //backend's (possibly sparse) contact identifiers onto them-- an
+    //open-addressed hash table of 2^contact_map_bits entries, kept at most
+    //half full-- and the set of slots in use.
+    struct oxtkbd_touch_slot *touch_slots;
+    unsigned int touch_slot_count;
+    unsigned int contact_map_bits;
+    struct oxtkbd_contact *contact_map;
+    DECLARE_BITMAP(slots_in_use, OXT_KBD_MAX_TOUCH_SLOTS);
+
+    //The contacts touching as of the last touch batch, indexed by contact
+    //identifier.
+    u32 batch_contacts;
+
+    //The pointer buttons currently pressed via the absolute pointer, whose
+    //releases must go the same way. Only touched by the pointer ring.
+    DECLARE_BITMAP(absolute_buttons, KEY_CNT);
+
+    //The fractional relative motion left over after scaling, in units of
+    //1/OXT_KBD_MOTION_SCALE_ONE.
+    int rel_residual_x, rel_residual_y;
+
+    //The size of each ring area, as a power-of-two number of pages; or
+    //true iff each ring area is instead part of a page shared with other
+    //devices. And where the out ring lives within ring zero's area, and
+    //its number of slots.
+    unsigned int ring_order;
+    bool shared_rings;
+    unsigned int out_ring_offs;
+    unsigned int out_ring_len;
+
+    //Protects each ring's IRQ against being steered while it's being bound
+    //or unbound.
+    struct mutex irq_lock;
+
+    //What the backend told us it supports, as of our last connection.
+    struct oxtkbd_backend_features features;
+
+    //The input devices we've registered, as a mask of OXT_KBD_REG_* bits.
+    //Registration runs asynchronously; register_cookie identifies it.
+    unsigned long registered;
+    async_cookie_t register_cookie;
+
+    //True iff we've asked to send output to the backend, and iff the
+    //backend's connected to receive it. Output waiting to be sent is kept
+    //as a mask of OXT_KBD_OUTPUT_* bits, and sent in batches by
+    //output_work; all of these are protected by output_lock.
+    bool output_events;
+    bool output_connected;
+    unsigned long output_pending;
+    u16 rumble_strong, rumble_weak;
+    spinlock_t output_lock;
+    struct delayed_work output_work;
+
+    //Watch on the backend's nodes, used to notice changes to its geometry.
+    struct xenbus_watch geometry_watch;
+
+    //Our input mirror, if input_mirror is set.
+    struct oxtkbd_mirror *mirror;
+
+    //The debugfs directory used to expose our statistics.
+    struct dentry *debugfs;
+
+    struct xenbus_device *xbdev;
+    char phys[32];
+};
+
+//The root of our debugfs hierarchy, shared by all devices.
+static struct dentry *oxtkbd_debugfs_root;
+
+//The domain in which our input devices are registered, so we only ever
+//wait on our own registrations.
+static ASYNC_DOMAIN_EXCLUSIVE(oxtkbd_async_domain);
+
+//The cache from which our information structures are allocated.
+static struct kmem_cache *oxtkbd_info_cache;
+
+//The number of shared ring areas that fit in a page.
+#define OXT_KBD_SHARED_AREAS_PER_PAGE  (PAGE_SIZE / OXT_KBD_SHARED_AREA_SIZE)
+
+/**
+ * A page whose ring areas are shared out between devices on the same
+ * backend, when share_ring_pages is set.
+ */
+struct oxtkbd_shared_page {
+    struct list_head list;
+    void *base;
+
+    //The backend every area in this page is granted to, and the areas in
+    //use, as a bitmap.
+    domid_t backend;
+    unsigned long in_use;
+};
+
+//Our shared pages, protected by oxtkbd_shared_page_lock.
+static LIST_HEAD(oxtkbd_shared_pages);
+static DEFINE_MUTEX(oxtkbd_shared_page_lock);
+
+/**
+ * An inclusive range of keycodes.
+ */
+struct oxtkbd_key_range {
+    u16 first, last;
+};
+
+/**
+ * A named set of keycodes that our keyboard device can register.
+ */
+struct oxtkbd_keymap_profile {
+    const char *name;
+    const struct oxtkbd_key_range *ranges;
+    unsigned int count;
+};
+
+//Every key the input core knows about.
+static const struct oxtkbd_key_range oxtkbd_full_keys[] = {
+    { KEY_ESC, KEY_UNKNOWN - 1 },
+    { KEY_OK,  KEY_MAX - 1 },
+};
+
+//The keys on a standard 105-key PC keyboard.
+#define OXT_KBD_PC105_KEYS                  \
+    { KEY_ESC,      KEY_KPDOT },            \
+    { KEY_102ND,    KEY_F12 },              \
+    { KEY_KPENTER,  KEY_RIGHTALT },         \
+    { KEY_HOME,     KEY_DELETE },           \
+    { KEY_PAUSE,    KEY_PAUSE },            \
+    { KEY_LEFTMETA, KEY_COMPOSE }
+
+static const struct oxtkbd_key_range oxtkbd_pc105_keys[] = {
+    OXT_KBD_PC105_KEYS,
+};
+
+//The same, plus the media keys commonly found on laptops and multimedia
+//keyboards.
+static const struct oxtkbd_key_range oxtkbd_pc105_media_keys[] = {
+    OXT_KBD_PC105_KEYS,
+    { KEY_MUTE,     KEY_POWER },
+    { KEY_CALC,     KEY_CALC },
+    { KEY_SLEEP,    KEY_WAKEUP },
+    { KEY_MAIL,     KEY_MAIL },
+    { KEY_BACK,     KEY_FORWARD },
+    { KEY_NEXTSONG, KEY_STOPCD },
+    { KEY_HOMEPAGE, KEY_REFRESH },
+    { KEY_SEARCH,   KEY_SEARCH },
+};
+
+static const struct oxtkbd_keymap_profile oxtkbd_keymap_profiles[] = {
+    { "full",        oxtkbd_full_keys,        ARRAY_SIZE(oxtkbd_full_keys) },
+    { "pc105",       oxtkbd_pc105_keys,       ARRAY_SIZE(oxtkbd_pc105_keys) },
+    { "pc105-media", oxtkbd_pc105_media_keys, ARRAY_SIZE(oxtkbd_pc105_media_keys) },
+};
+
+//Bits in openxt_kbd_info.registered.
+enum {
+    OXT_KBD_REG_KEYBOARD,
+    OXT_KBD_REG_RELATIVE,
+    OXT_KBD_REG_ABSOLUTE,
+};
+
+//Forward declarations.
+static int  oxtkbd_remove(struct xenbus_device *);
+static int  oxtkbd_connect_backend(struct xenbus_device *, struct openxt_kbd_info *);
+static int  oxtkbd_establish_connection(struct xenbus_device *, struct openxt_kbd_info *);
+static void oxtkbd_disconnect_backend(struct openxt_kbd_info *);
+static void __emit_touch_frame(struct oxtkbd_ring *);
+static void __update_touch_mode(struct oxtkbd_ring *);
+
+
+/**
+ * Returns the device that problems with the given combined device should be
+ * reported against: its XenBus device, or for a benchmark device, which has
+ * none, its keyboard.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static inline struct device *__info_dev(struct openxt_kbd_info *info)
+{
+    return info->xbdev ? &info->xbdev->dev : &info->keyboard->dev;
+}
+
+
+/**
+ * Delivers a single event to evdev, via one of our input devices. The event
+ * path reports everything through this and the helpers below, so that the
+ * benchmark can decode events exactly as we would for a real device, without
+ * ever registering an input device to deliver them to.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param dev The input device that should deliver the event.
+ * @param type, code, value The event to be delivered.
+ */
+static inline void __input_event(struct oxtkbd_ring *ring, struct input_dev *dev,
+        unsigned int type, unsigned int code, int value)
+{
+    if (likely(!ring->bench))
+        input_event(dev, type, code, value);
+}
+
+
+/**
+ * Selects the multi-touch slot that the following events apply to.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param dev The multi-touch input device.
+ * @param slot The slot to be selected.
+ */
+static inline void __input_mt_slot(struct oxtkbd_ring *ring, struct input_dev *dev, int slot)
+{
+    __input_event(ring, dev, EV_ABS, ABS_MT_SLOT, slot);
+}
+
+
+/**
+ * Reports whether the contact in the selected multi-touch slot is touching.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param dev The multi-touch input device.
+ * @param active True iff the contact is touching.
+ */
+static inline void __input_mt_slot_state(struct oxtkbd_ring *ring, struct input_dev *dev,
+        bool active)
+{
+    if (likely(!ring->bench))
+        input_mt_report_slot_state(dev, MT_TOOL_FINGER, active);
+}
+
+
+/**
+ * Ends a multi-touch frame, updating the device's emulated pointer.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param dev The multi-touch input device.
+ */
+static inline void __input_mt_sync_frame(struct oxtkbd_ring *ring, struct input_dev *dev)
+{
+    if (likely(!ring->bench))
+        input_mt_sync_frame(dev);
+}
+
+
+/**
+ * Completes a packet of events on the given device, stamping it with the
+ * time its input occurred, if we know it.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param dev The input device whose events should be delivered.
+ */
+static void __sync_device(struct oxtkbd_ring *ring, struct input_dev *dev)
+{
+    ring->syncs++;
+    if (unlikely(ring->bench))
+        return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+    if (ring->have_event_time)
+        input_set_timestamp(dev, ring->event_time);
+#endif
+
+    input_sync(dev);
+}
+
+
+/**
+ * Scales a single axis of relative motion, carrying any fractional part of
+ * the result over to the next motion on the same axis.
+ *
+ * @param delta The motion to be scaled.
+ * @param scale The scale factor, in units of 1/OXT_KBD_MOTION_SCALE_ONE.
+ * @param residual The fractional motion carried over from previous motion,
+ *      which is updated to hold the fractional part of this one.
+ *
+ * @return The whole part of the scaled motion.
+ */
+static inline int __scale_motion(int delta, int scale, int *residual)
+{
+    s64 scaled = (s64)delta * scale + *residual;
+    s64 whole  = scaled >> OXT_KBD_MOTION_SCALE_SHIFT;
+
+    *residual = scaled - (whole << OXT_KBD_MOTION_SCALE_SHIFT);
+    return whole;
+}
+
+
+/**
+ * Converts a position from the backend's coordinate space into the span of
+ * our absolute axes, if we're scaling absolute positions. Like the rest of
+ * the event path, must be called with the pointer ring's lock held, which
+ * keeps the scale consistent with the rest of our geometry.
+ *
+ * @param info The device information structure for the relevant PV input
+ *      device.
+ * @param x, y The position to be converted, which is updated in place.
+ */
+static inline void __scale_position(struct openxt_kbd_info *info, int *x, int *y)
+{
+    u64 scale;
+
+    if (!abs_scaling)
+        return;
+
+    scale = info->abs_scale;
+    *x = ((s64)*x * (u32)(scale >> 32)) >> OXT_KBD_ABS_SCALE_SHIFT;
+    *y = ((s64)*y * (u32)scale) >> OXT_KBD_ABS_SCALE_SHIFT;
+}
+
+
+/**
+ * Returns true iff the given pointer device exists and delivers pointer
+ * buttons. Our multi-touch absolute pointer doesn't.
+ *
+ * @param dev The pointer device to check, or NULL.
+ */
+static inline bool __has_pointer_buttons(struct input_dev *dev)
+{
+    return dev && test_bit(BTN_LEFT, dev->keybit);
+}
+
+
+/**
+ * Delivers a relative motion to evdev.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param rel_x, rel_y The relative pointer motion.
+ * @param rel_z The relative scroll wheel motion, as provided by the backend.
+ */
+static void __report_relative_motion(struct oxtkbd_ring *ring,
+        int rel_x, int rel_y, int rel_z)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int scale = READ_ONCE(motion_scale);
+
+    //If we're scaling motion, do so-- and if what's left doesn't amount to
+    //a whole unit of motion, there's nothing to report yet.
+    if (scale > 0 && scale != OXT_KBD_MOTION_SCALE_ONE) {
+        rel_x = __scale_motion(rel_x, scale, &info->rel_residual_x);
+        rel_y = __scale_motion(rel_y, scale, &info->rel_residual_y);
+
+        if (!rel_x && !rel_y && !rel_z)
+            return;
+    }
+
+    info->last_pointer = info->relative_pointer;
+
+    //Pass the relative movement on to evdev.
+    __input_event(ring, info->relative_pointer, EV_REL, REL_X, rel_x);
+    __input_event(ring, info->relative_pointer, EV_REL, REL_Y, rel_y);
+
+    //If the event has a Z-axis motion (a scroll wheel event),
+    //send that as well.
+    if (rel_z)
+        __input_event(ring, info->relative_pointer, EV_REL, REL_WHEEL, -rel_z);
+
+    __sync_device(ring, info->relative_pointer);
+}
+
+
+/**
+ * Delivers an absolute motion to evdev.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param abs_x, abs_y The new absolute pointer position.
+ * @param rel_z The relative scroll wheel motion, as provided by the backend.
+ */
+static void __report_absolute_motion(struct oxtkbd_ring *ring,
+        int abs_x, int abs_y, int rel_z)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    //Buttons that follow go via the absolute pointer, if it has any.
+    if (__has_pointer_buttons(info->absolute_pointer))
+        info->last_pointer = info->absolute_pointer;
+
+    //Send the new absolute coordinate...
+    __input_event(ring, info->absolute_pointer, EV_ABS, ABS_X, abs_x);
+    __input_event(ring, info->absolute_pointer, EV_ABS, ABS_Y, abs_y);
+
+    //... and if we have a scroll wheel event, send that too.
+    if (rel_z)
+        __input_event(ring, info->absolute_pointer, EV_REL, REL_WHEEL, -rel_z);
+
+    __sync_device(ring, info->absolute_pointer);
+}
+
+
+/**
+ * Delivers any relative motion accumulated while coalescing.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __flush_relative_motion(struct oxtkbd_ring *ring)
+{
+    if (!ring->pending.rel_pending)
+        return;
+
+    __report_relative_motion(ring, ring->pending.rel_x,
+            ring->pending.rel_y, ring->pending.rel_z);
+    ring->pending.rel_pending = false;
+}
+
+
+/**
+ * Returns true iff touches should be collected into frames, rather than
+ * delivered as they arrive.
+ */
+static inline bool __wants_touch_dedupe(void)
+{
+    return touch_dedupe || priority_drain;
+}
+
+
+/**
+ * Delivers any touch frame being held until the end of the pass, and picks
+ * up any change in how we handle touches, now that we're between frames.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __flush_touch_frame(struct oxtkbd_ring *ring)
+{
+    if (!ring->frame_pending)
+        return;
+
+    __emit_touch_frame(ring);
+    __update_touch_mode(ring);
+}
+
+
+/**
+ * Delivers any absolute motion accumulated while coalescing.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __flush_absolute_motion(struct oxtkbd_ring *ring)
+{
+    if (!ring->pending.abs_pending)
+        return;
+
+    //Any touch frame we're holding came first.
+    __flush_touch_frame(ring);
+
+    __report_absolute_motion(ring, ring->pending.abs_x,
+            ring->pending.abs_y, ring->pending.abs_z);
+    ring->pending.abs_pending = false;
+}
+
+
+/**
+ * Delivers all motion accumulated while coalescing, and any touch frame
+ * we're holding.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __flush_pending_motion(struct oxtkbd_ring *ring)
+{
+    __flush_relative_motion(ring);
+    __flush_touch_frame(ring);
+    __flush_absolute_motion(ring);
+}
+
+
+/**
+ * Handler for relative motion events.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The relative motion event to be handled.
+ */
+static void __handle_relative_motion(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    trace_oxtkbd_handle_motion(ring->index, &ring->page->in_prod, ring->cursor,
+            event->type, event->motion.rel_z, event->motion.rel_x, event->motion.rel_y);
+
+    //If we're not coalescing, pass the motion straight on.
+    if (!ring->coalescing) {
+        __report_relative_motion(ring, event->motion.rel_x,
+                event->motion.rel_y, event->motion.rel_z);
+        return;
+    }
+
+    //Otherwise, add this motion to the motion we've already seen this pass.
+    if (!ring->pending.rel_pending) {
+        ring->pending.rel_x = 0;
+        ring->pending.rel_y = 0;
+        ring->pending.rel_z = 0;
+        ring->pending.rel_pending = true;
+    }
+
+    ring->pending.rel_x += event->motion.rel_x;
+    ring->pending.rel_y += event->motion.rel_y;
+    ring->pending.rel_z += event->motion.rel_z;
+}
+
+
+/**
+ * Handler for pure absolute (e.g. touchpad) movements.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The absolute motion event to be handled.
+ */
+static void __handle_absolute_motion(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int x = event->pos.abs_x, y = event->pos.abs_y;
+
+    __scale_position(info, &x, &y);
+    trace_oxtkbd_handle_position(ring->index, &ring->page->in_prod, ring->cursor,
+            event->type, event->pos.rel_z, x, y);
+
+    //If we're not coalescing, pass the motion straight on.
+    if (!ring->coalescing) {
+        __report_absolute_motion(ring, x, y, event->pos.rel_z);
+        return;
+    }
+
+    //Otherwise, only the latest position matters-- but scroll wheel
+    //motion is relative, and needs to be summed.
+    if (!ring->pending.abs_pending) {
+        ring->pending.abs_z = 0;
+        ring->pending.abs_pending = true;
+    }
+
+    ring->pending.abs_x  = x;
+    ring->pending.abs_y  = y;
+    ring->pending.abs_z += event->pos.rel_z;
+}
+
+
+/**
+ * Returns the index of the contact map entry for the given contact, or of
+ * the empty entry where it would be inserted.
+ *
+ * @param info The device information structure for the relevant PV input
+ *      device.
+ * @param id The backend's identifier for the contact.
+ */
+static unsigned int __contact_map_find(struct openxt_kbd_info *info, s32 id)
+{
+    unsigned int mask = (1U << info->contact_map_bits) - 1;
+    unsigned int i = hash_32((u32)id, info->contact_map_bits);
+
+    //As the table is never more than half full, this always terminates.
+    while (info->contact_map[i].slot >= 0 && info->contact_map[i].id != id)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+
+/**
+ * Removes a contact from the contact map, shifting back any entries that
+ * were displaced by it so that lookups never need to skip empty entries.
+ *
+ * @param info The device information structure for the relevant PV input
+ *      device.
+ * @param id The backend's identifier for the contact.
+ */
+static void __contact_map_remove(struct openxt_kbd_info *info, s32 id)
+{
+    unsigned int mask = (1U << info->contact_map_bits) - 1;
+    unsigned int i = __contact_map_find(info, id);
+    unsigned int j = i;
+
+    if (info->contact_map[i].slot < 0)
+        return;
+
+    for (;;) {
+        unsigned int home;
+
+        j = (j + 1) & mask;
+        if (info->contact_map[j].slot < 0)
+            break;
+
+        //If entry j's home position lies (cyclically) within (i, j], it's
+        //still reachable without entry i, and can stay put.
+        home = hash_32((u32)info->contact_map[j].id, info->contact_map_bits);
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        info->contact_map[i] = info->contact_map[j];
+        i = j;
+    }
+
+    info->contact_map[i].slot = -1;
+}
+
+
+/**
+ * Forgets every contact in the contact map.
+ *
+ * @param info The device information structure for the relevant PV input
+ *      device.
+ */
+static void __contact_map_reset(struct openxt_kbd_info *info)
+{
+    unsigned int i;
+
+    for (i = 0; i < (1U << info->contact_map_bits); i++)
+        info->contact_map[i].slot = -1;
+
+    bitmap_zero(info->slots_in_use, OXT_KBD_MAX_TOUCH_SLOTS);
+}
+
+
+/**
+ * Returns true iff we're letting the input core map contacts onto slots.
+ * The benchmark never does, as the input core never sees its contacts.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static inline bool __kernel_tracking(struct oxtkbd_ring *ring)
+{
+    return mt_kernel_tracking && !ring->info->deduplicating_touches && !ring->bench;
+}
+
+
+/**
+ * Finds the touch slot used for a given contact.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param id The backend's identifier for the contact.
+ * @param allocate True iff a new slot should be allocated for the contact,
+ *      if it doesn't already have one.
+ *
+ * @return The contact's slot, or -1 if it has none.
+ */
+static int __contact_slot(struct oxtkbd_ring *ring, s32 id, bool allocate)
+{
+    struct openxt_kbd_info *info = ring->info;
+    unsigned int i, slot;
+
+    //If we're letting the input core track contacts, ask it-- though it
+    //gives any contact it doesn't know a slot, so only ask it to find one
+    //we're allowed to allocate.
+    if (__kernel_tracking(ring)) {
+        struct input_mt *mt = info->absolute_pointer->mt;
+
+        if (allocate)
+            return input_mt_get_slot_by_key(info->absolute_pointer, id);
+
+        for (i = 0; i < mt->num_slots; i++)
+            if (input_mt_is_active(&mt->slots[i]) && mt->slots[i].key == id)
+                return i;
+
+        return -1;
+    }
+
+    i = __contact_map_find(info, id);
+    if (info->contact_map[i].slot >= 0)
+        return info->contact_map[i].slot;
+
+    if (!allocate)
+        return -1;
+
+    //Otherwise, give the contact the first free slot-- if there is one.
+    slot = find_first_zero_bit(info->slots_in_use, info->touch_slot_count);
+    if (slot >= info->touch_slot_count) {
+        oxtkbd_stat_inc(info, unmapped_contacts);
+        return -1;
+    }
+
+    __set_bit(slot, info->slots_in_use);
+    info->contact_map[i].id   = id;
+    info->contact_map[i].slot = slot;
+    info->touch_slots[slot].id = id;
+    return slot;
+}
+
+
+/**
+ * Frees the touch slot used for a given contact, once it's been lifted.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param slot The slot to be freed.
+ */
+static void __release_contact_slot(struct oxtkbd_ring *ring, int slot)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    //The input core frees its own slots.
+    if (__kernel_tracking(ring))
+        return;
+
+    __contact_map_remove(info, info->touch_slots[slot].id);
+    __clear_bit(slot, info->slots_in_use);
+}
+
+
+/**
+ * Delivers the differences between the touch contact state we've collected
+ * and the state we last reported, ending the current touch frame.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __emit_touch_frame(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int i;
+
+    ring->frame_pending = false;
+
+    for (i = 0; i < info->touch_slot_count; i++) {
+        struct oxtkbd_touch_slot *slot = &info->touch_slots[i];
+        bool state_changed = (slot->down != slot->reported_down);
+        bool moved = slot->down &&
+            (state_changed || slot->x != slot->reported_x || slot->y != slot->reported_y);
+
+        if (!slot->dirty)
+            continue;
+
+        slot->dirty = false;
+
+        if (!state_changed && !moved)
+            continue;
+
+        __input_mt_slot(ring, info->absolute_pointer, i);
+
+        if (state_changed) {
+            __input_mt_slot_state(ring, info->absolute_pointer, slot->down);
+            slot->reported_down = slot->down;
+
+            //Once a contact's been lifted, its slot is free for reuse.
+            if (!slot->down)
+                __release_contact_slot(ring, i);
+        }
+
+        if (moved) {
+            __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_X, slot->x);
+            __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_Y, slot->y);
+            slot->reported_x = slot->x;
+            slot->reported_y = slot->y;
+        }
+    }
+
+    __input_mt_sync_frame(ring, info->absolute_pointer);
+    __sync_device(ring, info->absolute_pointer);
+}
+
+
+/**
+ * Records a change to a touch contact, to be delivered at the next frame.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param id The backend's identifier for the contact.
+ * @param down True iff the contact is touching the screen.
+ * @param has_position True iff x and y provide the contact's new position.
+ * @param x, y The contact's new position.
+ */
+static void __record_touch(struct oxtkbd_ring *ring, s32 id, bool down,
+        bool has_position, int x, int y)
+{
+    struct openxt_kbd_info *info = ring->info;
+    struct oxtkbd_touch_slot *slot;
+    int index = __contact_slot(ring, id, down);
+
+    if (index < 0)
+        return;
+
+    slot = &info->touch_slots[index];
+
+    //A contact can only go down or up once per frame. If it's doing so a
+    //second time-- say, for a tap shorter than a frame-- end the frame
+    //early, so the tap isn't lost. This may free the contact's slot, so
+    //look it up again afterwards.
+    if (down != slot->down && slot->down != slot->reported_down) {
+        __emit_touch_frame(ring);
+
+        index = __contact_slot(ring, id, down);
+        if (index < 0)
+            return;
+
+        slot = &info->touch_slots[index];
+    }
+
+    slot->down  = down;
+    slot->dirty = true;
+
+    if (has_position) {
+        slot->x = x;
+        slot->y = y;
+    }
+}
+
+
+/**
+ * Handler for multitouch touch events.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ *
+ * @return True iff the contact's position should now be reported: that is,
+ *      iff its slot has been selected, or it's being recorded for the next
+ *      frame. False if the contact had to be dropped.
+ */
+static bool __handle_touch_down(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int slot;
+
+    //Trace the position as we'll report it, but don't scale it just for a
+    //tracepoint that isn't enabled.
+    if (trace_oxtkbd_handle_touch_enabled()) {
+        int x = event->touch_down.abs_x, y = event->touch_down.abs_y;
+
+        __scale_position(info, &x, &y);
+        trace_oxtkbd_handle_touch(ring->index, &ring->page->in_prod, ring->cursor,
+                event->type, event->touch_down.id, x, y);
+    }
+
+    if (info->deduplicating_touches) {
+        __record_touch(ring, event->touch_down.id, true, false, 0, 0);
+        return true;
+    }
+
+    //Send an indication that the given finger has been pressed...
+    slot = __contact_slot(ring, event->touch_down.id, true);
+    if (slot < 0)
+        return false;
+
+    __input_mt_slot(ring, info->absolute_pointer, slot);
+    __input_mt_slot_state(ring, info->absolute_pointer, 1);
+    return true;
+}
+
+
+/**
+ * Handler for multitouch touch events.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ */
+static void __handle_touch_movement(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event, int report_slot, int send_abs_event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int x = event->touch_move.abs_x, y = event->touch_move.abs_y;
+
+    __scale_position(info, &x, &y);
+
+    //Touch downs are traced by __handle_touch_down.
+    if (event->type == OXT_KBD_TYPE_TOUCH_MOVE)
+        trace_oxtkbd_handle_touch(ring->index, &ring->page->in_prod, ring->cursor,
+                event->type, event->touch_move.id, x, y);
+
+    if (info->deduplicating_touches) {
+        __record_touch(ring, event->touch_move.id, true, true, x, y);
+        return;
+    }
+
+    //Send the slot number, which determines which "finger" is providing
+    //the touch event.
+    if (report_slot) {
+        int slot = __contact_slot(ring, event->touch_move.id, true);
+        if (slot < 0)
+            return;
+
+        __input_mt_slot(ring, info->absolute_pointer, slot);
+    }
+
+    //... the multi-touch coordinates...
+    __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_X, x);
+    __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_Y, y);
+
+    //... and absolute touch points, if desired.
+    //Note that we only send the absolute touch events for slot zero-- the other "fingers"
+    //only send multi-touch events!
+    if (send_abs_event && (event->touch_move.id == 0)) {
+        __input_event(ring, info->absolute_pointer, EV_ABS, ABS_X, x);
+        __input_event(ring, info->absolute_pointer, EV_ABS, ABS_Y, y);
+    }
+}
+
+
+/**
+ * Handler for packed multitouch movement events, which carry several
+ * contacts at once.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ */
+static void __handle_packed_touch_movement(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int i, slot;
+    struct oxtkbd_touch_move_packed *packed = &event->touch_move_packed;
+    int count = min_t(int, packed->count, OXT_KBD_PACKED_TOUCH_CONTACTS);
+
+    //Report each contact exactly as we would a lone touch movement.
+    for (i = 0; i < count; i++) {
+        int x = packed->contacts[i].abs_x, y = packed->contacts[i].abs_y;
+
+        __scale_position(info, &x, &y);
+        trace_oxtkbd_handle_touch(ring->index, &ring->page->in_prod, ring->cursor,
+                event->type, packed->contacts[i].id, x, y);
+
+        if (info->deduplicating_touches) {
+            __record_touch(ring, packed->contacts[i].id, true, true, x, y);
+            continue;
+        }
+
+        slot = __contact_slot(ring, packed->contacts[i].id, true);
+        if (slot < 0)
+            continue;
+
+        __input_mt_slot(ring, info->absolute_pointer, slot);
+        __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_X, x);
+        __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_Y, y);
+    }
+}
+
+
+/**
+ * Handler for multitouch touch events.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ */
+static void __handle_touch_up(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int slot;
+
+    trace_oxtkbd_handle_touch(ring->index, &ring->page->in_prod, ring->cursor,
+            event->type, event->touch_up.id, 0, 0);
+
+    if (info->deduplicating_touches) {
+        __record_touch(ring, event->touch_up.id, false, false, 0, 0);
+        return;
+    }
+
+    //Send an indication that the given finger has been released...
+    slot = __contact_slot(ring, event->touch_up.id, false);
+    if (slot < 0)
+        return;
+
+    __input_mt_slot(ring, info->absolute_pointer, slot);
+    __input_mt_slot_state(ring, info->absolute_pointer, 0);
+
+    //... which frees up its slot for another contact.
+    __release_contact_slot(ring, slot);
+}
+
+
+/**
+ * Handle touch framing events.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ */
+static void __handle_touch_framing(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    trace_oxtkbd_handle_touch_frame(ring->index, &ring->page->in_prod, ring->cursor,
+            event->type, 0, 0, 0);
+
+    if (info->deduplicating_touches) {
+        //If we're prioritizing keys, hold the frame until the end of the
+        //pass, so that any frames after it are merged into it.
+        if (ring->prioritizing) {
+            ring->frame_pending = true;
+            return;
+        }
+
+        __emit_touch_frame(ring);
+    }
+    else {
+        __input_mt_sync_frame(ring, info->absolute_pointer);
+        __sync_device(ring, info->absolute_pointer);
+    }
+
+    //Now that we're between frames, pick up any change in mode.
+    __update_touch_mode(ring);
+}
+
+
+/**
+ * Converts a time on the backend's clock to our own, using our current
+ * estimate of the offset between them.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param timestamp_ns The backend's time, in nanoseconds.
+ */
+static inline ktime_t __backend_to_local_time(struct oxtkbd_ring *ring, u64 timestamp_ns)
+{
+    return ns_to_ktime(timestamp_ns + min(ring->clock_offset, ring->prev_clock_offset));
+}
+
+
+/**
+ * Handler for timestamp records, which give the backend's time for the
+ * events that follow.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The timestamp record to be handled.
+ */
+static void __handle_timestamp(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    ktime_t now = ktime_get();
+    s64 offset = ktime_to_ns(now) - event->timestamp.timestamp_ns;
+
+    //Our clocks are unrelated, so we don't know the true offset between
+    //them. The smallest offset we see is the true offset plus the smallest
+    //possible delivery delay, which is the best estimate we'll get. We keep
+    //two windows' worth of minima, so the estimate can follow clock drift.
+    if (!ring->have_event_time ||
+            ktime_to_ns(ktime_sub(now, ring->clock_window_start)) > OXT_KBD_CLOCK_WINDOW_NS) {
+        ring->prev_clock_offset  = ring->have_event_time ? ring->clock_offset : offset;
+        ring->clock_offset       = offset;
+        ring->clock_window_start = now;
+    }
+    else if (offset < ring->clock_offset) {
+        ring->clock_offset = offset;
+    }
+
+    ring->event_time = __backend_to_local_time(ring, event->timestamp.timestamp_ns);
+    ring->have_event_time = true;
+
+    oxtkbd_stat_inc(info, latency[__hist_bucket(ktime_to_ns(ktime_sub(now, ring->event_time)))]);
+}
+
+
+/**
+ * Looks up the route for a given keycode in the key routing table.
+ *
+ * @param info The device information structure for the relevant PV input
+ *      device.
+ * @param keycode The keycode to be routed.
+ */
+static inline enum oxtkbd_key_route __key_route(struct openxt_kbd_info *info,
+        __u32 keycode)
+{
+    unsigned int shift;
+
+    if (keycode >= KEY_CNT)
+        return OXT_KBD_ROUTE_NONE;
+
+    shift = (keycode % OXT_KBD_ROUTES_PER_BYTE) * OXT_KBD_ROUTE_BITS;
+    return (info->key_route[keycode / OXT_KBD_ROUTES_PER_BYTE] >> shift) & OXT_KBD_ROUTE_MASK;
+}
+
+
+/**
+ * Handler for keypress events, including mouse button "keys".
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The keypress event to be handled.
+ */
+static void __handle_key_or_button_press(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    struct input_dev *dev;
+    __u32 keycode = event->key.keycode;
+
+    trace_oxtkbd_handle_key(ring->index, &ring->page->in_prod, ring->cursor,
+            event->type, keycode, event->key.pressed, 0);
+
+    //Look up which device should deliver this key. Keyboard keys go via
+    //the keyboard device; pointer buttons are pressed via whichever pointer
+    //device last moved, and released via the device they were pressed on--
+    //even if the other pointer has moved since. We quietly drop anything we
+    //don't know how to deliver.
+    switch (__key_route(info, keycode)) {
+
+    case OXT_KBD_ROUTE_KEYBOARD:
+        dev = ring->keyboard_events ? info->keyboard : NULL;
+        break;
+
+    case OXT_KBD_ROUTE_POINTER:
+        if (!ring->pointer_events)
+            dev = NULL;
+        else if (event->key.pressed)
+            dev = READ_ONCE(info->last_pointer);
+        else if (test_bit(keycode, info->absolute_buttons))
+            dev = info->absolute_pointer;
+        else
+            dev = info->relative_pointer ? info->relative_pointer : info->absolute_pointer;
+
+        if (dev == info->absolute_pointer && event->key.pressed)
+            __set_bit(keycode, info->absolute_buttons);
+        else
+            __clear_bit(keycode, info->absolute_buttons);
+        break;
+
+    default:
+        oxtkbd_stat_inc(info, unknown_keycodes);
+        dev_dbg_ratelimited(__info_dev(info), "unhandled keycode 0x%x\n", keycode);
+        return;
+    }
+
+    //Each device's events only ever arrive on one ring, so that rings can
+    //be handled concurrently.
+    if (!dev) {
+        oxtkbd_stat_inc(info, undeliverable_events);
+        return;
+    }
+
+    __input_event(ring, dev, EV_KEY, keycode, !!event->key.pressed);
+    __sync_device(ring, dev);
+}
+
+
+/**
+ * Returns the event at the given (free-running) index into the in ring.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param idx The index of the event to be fetched.
+ */
+static inline union oxtkbd_in_event *__ring_event(struct oxtkbd_ring *ring,
+        __u32 idx)
+{
+    struct openxt_kbd_info *info = ring->info;
+    char *slots = (char *)ring->page + info->in_ring_offs;
+
+    //Only the legacy layout has a ring length that isn't a power of two; for
+    //everything else, we can mask rather than divide.
+    if (likely(is_power_of_2(info->ring_len)))
+        idx &= info->ring_len - 1;
+    else
+        idx %= info->ring_len;
+
+    return (union oxtkbd_in_event *)(slots + idx * info->slot_size);
+}
+
+
+/**
+ * Returns the value in_prod must reach before there's anything on the ring
+ * we can consume: usually, one past in_cons; but if the record at the head
+ * of the ring is incomplete, the end of that record.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static inline __u32 __ring_wanted(struct oxtkbd_ring *ring)
+{
+    return ring->incomplete ? ring->incomplete_until : ring->page->in_cons + 1;
+}
+
+
+/**
+ * Returns true iff the backend has placed events on the ring that we
+ * have yet to consume, and can.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static inline int __ring_has_events(struct oxtkbd_ring *ring)
+{
+    __u32 cons = ring->page->in_cons;
+
+    return ring->page->in_prod - cons >= __ring_wanted(ring) - cons;
+}
+
+
+/**
+ * Returns the number of ring slots occupied by a touch batch record.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch batch record.
+ */
+static unsigned int __touch_batch_span(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    return OXT_KBD_TOUCH_BATCH_SLOTS(hweight32(event->touch_batch.contacts),
+            ring->info->slot_size);
+}
+
+
+/**
+ * Returns the n-th position carried by the touch batch record currently
+ * being handled, which may lie in one of the slots that follow it.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param n The index of the position to be returned.
+ */
+static inline struct oxtkbd_batch_position *__touch_batch_position(
+        struct oxtkbd_ring *ring, unsigned int n)
+{
+    unsigned int slot_size = ring->info->slot_size;
+    unsigned int offset = OXT_KBD_TOUCH_BATCH_HEADER_SIZE +
+        n * sizeof(struct oxtkbd_batch_position);
+
+    //Slot sizes are a multiple of the position size, so a position never
+    //straddles two slots.
+    return (struct oxtkbd_batch_position *)
+        ((char *)__ring_event(ring, ring->cursor + offset / slot_size) + offset % slot_size);
+}
+
+
+/**
+ * Handler for touch batch records, which describe an entire touch frame.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch batch record to be handled.
+ */
+static void __handle_touch_batch(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+    unsigned long touching = event->touch_batch.contacts;
+    unsigned long previous = info->batch_contacts;
+    unsigned long lifted = previous & ~touching;
+    unsigned int id, n = 0;
+    int slot;
+
+    //Lift any contacts that have left, first, so that their slots are
+    //free for any contacts that have just arrived.
+    for_each_set_bit(id, &lifted, OXT_KBD_TOUCH_BATCH_MAX_CONTACTS) {
+        trace_oxtkbd_handle_touch(ring->index, &ring->page->in_prod, ring->cursor,
+                event->type, id, 0, 0);
+
+        if (info->deduplicating_touches) {
+            __record_touch(ring, id, false, false, 0, 0);
+            continue;
+        }
+
+        slot = __contact_slot(ring, id, false);
+        if (slot < 0)
+            continue;
+
+        __input_mt_slot(ring, info->absolute_pointer, slot);
+        __input_mt_slot_state(ring, info->absolute_pointer, 0);
+        __release_contact_slot(ring, slot);
+    }
+
+    //Then report each contact that's touching, new or not. Its slot may
+    //have only just been allocated even if it was touching before, as
+    //there may have been no slot free for it then, so we always report
+    //its slot state; the input core keeps an active slot's tracking ID,
+    //and drops the repeated values.
+    for_each_set_bit(id, &touching, OXT_KBD_TOUCH_BATCH_MAX_CONTACTS) {
+        struct oxtkbd_batch_position *position = __touch_batch_position(ring, n++);
+        int x = position->abs_x, y = position->abs_y;
+
+        __scale_position(info, &x, &y);
+        trace_oxtkbd_handle_touch(ring->index, &ring->page->in_prod, ring->cursor,
+                event->type, id, x, y);
+
+        if (info->deduplicating_touches) {
+            __record_touch(ring, id, true, true, x, y);
+            continue;
+        }
+
+        slot = __contact_slot(ring, id, true);
+        if (slot < 0)
+            continue;
+
+        __input_mt_slot(ring, info->absolute_pointer, slot);
+        __input_mt_slot_state(ring, info->absolute_pointer, 1);
+        __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_X, x);
+        __input_event(ring, info->absolute_pointer, EV_ABS, ABS_MT_POSITION_Y, y);
+    }
+
+    info->batch_contacts = touching;
+
+    //Each batch ends its frame.
+    __handle_touch_framing(ring, event);
+}
+
+
+/**
+ * Handler for a touch press, which also gives the new contact's position.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ */
+static void __handle_touch_press(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    //If we had to drop the contact, no slot was selected for it; so its
+    //position would land on whichever contact was selected last.
+    if (__handle_touch_down(ring, event))
+        __handle_touch_movement(ring, event, false, false);
+}
+
+
+/**
+ * Handler for the movement of a single touch contact.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The touch event to be handled.
+ */
+static void __handle_touch_move(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    __handle_touch_movement(ring, event, true, false);
+}
+
+
+/**
+ * Flags describing how each type of event is dispatched.
+ */
+enum oxtkbd_event_flags {
+    //The event is delivered via a pointer device, so it's only accepted on
+    //a ring that carries pointer events.
+    OXT_KBD_EV_POINTER    = 1 << 0,
+
+    //The event can only be delivered if we have a relative pointer, an
+    //absolute pointer, or an absolute pointer that supports multi-touch.
+    //(Key events are checked when they're routed, instead.)
+    OXT_KBD_EV_RELATIVE   = 1 << 1,
+    OXT_KBD_EV_ABSOLUTE   = 1 << 2,
+    OXT_KBD_EV_MULTITOUCH = 1 << 3,
+
+    //Any absolute motion-- or any motion at all-- we're holding must be
+    //delivered before the event, so the two aren't reordered. Touches
+    //can't overtake pointer motion; and a button press has to land where
+    //the pointer was when it happened.
+    OXT_KBD_EV_FLUSH_ABS  = 1 << 4,
+    OXT_KBD_EV_FLUSH_ALL  = 1 << 5,
+};
+
+
+/**
+ * How a single type of event is dispatched.
+ */
+struct oxtkbd_event_handler {
+    void (*handle)(struct oxtkbd_ring *ring, union oxtkbd_in_event *event);
+    unsigned int flags;
+
+    //For records that occupy more than one ring slot, returns the number
+    //of slots the record occupies.
+    unsigned int (*span)(struct oxtkbd_ring *ring, union oxtkbd_in_event *event);
+};
+
+#define OXT_KBD_EV_TOUCH (OXT_KBD_EV_POINTER | OXT_KBD_EV_ABSOLUTE | OXT_KBD_EV_MULTITOUCH)
+
+//Dispatch table, indexed by event type. Types without a handler are
+//unknown to us, and are ignored.
+static const struct oxtkbd_event_handler oxtkbd_event_handlers[] = {
+    [OXT_KBD_TYPE_MOTION]             = { __handle_relative_motion,
+                                          OXT_KBD_EV_POINTER | OXT_KBD_EV_RELATIVE },
+    [OXT_KBD_TYPE_KEY]                = { __handle_key_or_button_press,
+                                          OXT_KBD_EV_FLUSH_ALL },
+    [OXT_KBD_TYPE_POS]                = { __handle_absolute_motion,
+                                          OXT_KBD_EV_POINTER | OXT_KBD_EV_ABSOLUTE },
+    [OXT_KBD_TYPE_TOUCH_DOWN]         = { __handle_touch_press,
+                                          OXT_KBD_EV_TOUCH | OXT_KBD_EV_FLUSH_ABS },
+    [OXT_KBD_TYPE_TOUCH_UP]           = { __handle_touch_up,
+                                          OXT_KBD_EV_TOUCH | OXT_KBD_EV_FLUSH_ABS },
+    [OXT_KBD_TYPE_TOUCH_MOVE]         = { __handle_touch_move,
+                                          OXT_KBD_EV_TOUCH | OXT_KBD_EV_FLUSH_ABS },
+    [OXT_KBD_TYPE_TOUCH_FRAME]        = { __handle_touch_framing,
+                                          OXT_KBD_EV_TOUCH },
+    [OXT_KBD_TYPE_TOUCH_MOVE_PACKED]  = { __handle_packed_touch_movement,
+                                          OXT_KBD_EV_TOUCH | OXT_KBD_EV_FLUSH_ABS },
+
+    //Motion we're holding happened at the previous timestamp.
+    [OXT_KBD_TYPE_TIMESTAMP]          = { __handle_timestamp,
+                                          OXT_KBD_EV_FLUSH_ALL },
+
+    [OXT_KBD_TYPE_TOUCH_BATCH]        = { __handle_touch_batch,
+                                          OXT_KBD_EV_TOUCH | OXT_KBD_EV_FLUSH_ABS,
+                                          __touch_batch_span },
+};
+
+
+/**
+ * Returns the dispatch table entry for the given event, or NULL if we
+ * don't know how to handle it.
+ *
+ * @param event The event to be handled.
+ */
+static inline const struct oxtkbd_event_handler *__event_handler(union oxtkbd_in_event *event)
+{
+    const struct oxtkbd_event_handler *handler;
+
+    if (event->type >= ARRAY_SIZE(oxtkbd_event_handlers))
+        return NULL;
+
+    handler = &oxtkbd_event_handlers[event->type];
+    return handler->handle ? handler : NULL;
+}
+
+
+/**
+ * Returns the number of ring slots occupied by the record starting with
+ * the given event.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param handler The dispatch table entry for the event, or NULL if it has
+ *      none.
+ * @param event The first slot of the record.
+ */
+static inline unsigned int __event_span(struct oxtkbd_ring *ring,
+        const struct oxtkbd_event_handler *handler, union oxtkbd_in_event *event)
+{
+    return (handler && handler->span) ? handler->span(ring, event) : 1;
+}
+
+
+/**
+ * Returns true iff we have a device that can deliver events of a given
+ * type, and events of that type are ones we accept on this ring.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param flags The dispatch flags for the type of event to be checked.
+ */
+static inline bool __can_deliver(struct oxtkbd_ring *ring, unsigned int flags)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    if ((flags & OXT_KBD_EV_POINTER) && !ring->pointer_events)
+        return false;
+    if ((flags & OXT_KBD_EV_RELATIVE) && !info->relative_pointer)
+        return false;
+    if ((flags & OXT_KBD_EV_ABSOLUTE) && !info->absolute_pointer)
+        return false;
+
+    //Multi-touch events always require the absolute pointer, as well.
+    if ((flags & OXT_KBD_EV_MULTITOUCH) && !info->absolute_pointer->mt)
+        return false;
+
+    return true;
+}
+
+
+/**
+ * Lifts every touch contact, and forgets any touch state we've collected,
+ * so nothing we collected is reported afterwards. The caller must sync the
+ * absolute pointer.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __lift_all_contacts(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+    struct input_dev *dev = info->absolute_pointer;
+    int slot;
+
+    memset(info->touch_slots, 0, info->touch_slot_count * sizeof(*info->touch_slots));
+    __contact_map_reset(info);
+    info->batch_contacts = 0;
+
+    if (!dev || !dev->mt)
+        return;
+
+    for (slot = 0; slot < dev->mt->num_slots; slot++) {
+        __input_mt_slot(ring, dev, slot);
+        __input_mt_slot_state(ring, dev, 0);
+    }
+    __input_mt_sync_frame(ring, dev);
+}
+
+
+/**
+ * Picks up any change in whether we're deduplicating touches. Must only be
+ * called between touch frames.
+ *
+ * The two modes track contacts differently-- with kernel contact tracking,
+ * not even via the same map-- so neither can take over the other's
+ * contacts. Instead, we lift every contact as we switch, just as we do
+ * after losing events.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __update_touch_mode(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+    bool deduplicate = __wants_touch_dedupe();
+
+    if (deduplicate == info->deduplicating_touches)
+        return;
+
+    if (info->absolute_pointer) {
+        __lift_all_contacts(ring);
+        __sync_device(ring, info->absolute_pointer);
+    }
+
+    info->deduplicating_touches = deduplicate;
+}
+
+
+/**
+ * Releases every key, button and touch contact delivered via the given
+ * ring that's currently held down.
+ * Used after losing events, as some of the lost events may have been the
+ * releases that correspond to the current presses.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __release_all_inputs(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+    int i, code;
+    struct input_dev *devices[] = {
+        ring->keyboard_events ? info->keyboard : NULL,
+        ring->pointer_events ? info->relative_pointer : NULL,
+        ring->pointer_events ? info->absolute_pointer : NULL,
+    };
+
+    __flush_pending_motion(ring);
+
+    if (ring->pointer_events) {
+        __lift_all_contacts(ring);
+        bitmap_zero(info->absolute_buttons, KEY_CNT);
+    }
+
+    //Only release inputs delivered via this ring; the others belong to
+    //rings that may be being handled concurrently.
+    for (i = 0; i < ARRAY_SIZE(devices); i++) {
+        if (!devices[i])
+            continue;
+
+        for_each_set_bit(code, devices[i]->key, KEY_CNT)
+            __input_event(ring, devices[i], EV_KEY, code, 0);
+
+        __sync_device(ring, devices[i]);
+    }
+}
+
+
+/**
+ * Returns true iff the given event should still be handled while we're
+ * recovering from a ring overrun. We keep only events that release inputs,
+ * so nothing gets stuck down; motion is stale by now, and replaying stale
+ * presses would only produce spurious input.
+ *
+ * @param event The event to be checked.
+ */
+static bool __survives_overrun(union oxtkbd_in_event *event)
+{
+    switch (event->type) {
+
+    case OXT_KBD_TYPE_KEY:
+        return !event->key.pressed;
+
+    case OXT_KBD_TYPE_TOUCH_UP:
+    case OXT_KBD_TYPE_TOUCH_FRAME:
+    case OXT_KBD_TYPE_TIMESTAMP:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * Returns true iff the given event is a keyboard key that we'd deliver via
+ * this ring, and which can therefore be delivered ahead of other events.
+ * Pointer buttons are never prioritized, as they apply wherever the pointer
+ * was when they happened.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param event The event to be checked.
+ */
+static inline bool __is_priority_key(struct oxtkbd_ring *ring,
+        union oxtkbd_in_event *event)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    if (event->type != OXT_KBD_TYPE_KEY)
+        return false;
+
+    return ring->keyboard_events && info->keyboard &&
+        (__key_route(info, event->key.keycode) == OXT_KBD_ROUTE_KEYBOARD);
+}
+
+
+/**
+ * Delivers the keyboard keys in part of the ring ahead of the other events
+ * around them. Keys keep their order relative to each other, and the time
+ * given by the timestamp record before them.
+ *
+ * We stop at the first pointer button: a modifier held across a click
+ * (Ctrl-click, or Shift-drag) has to stay held until the click's been
+ * delivered, so no key after a button can be moved ahead of it.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param start The index of the first event to be scanned.
+ * @param prod The index just past the last event to be scanned.
+ *
+ * @return The index just past the last event scanned; only keys before
+ *      this index have been delivered.
+ */
+static __u32 __prioritize_keys(struct oxtkbd_ring *ring, __u32 start, __u32 prod)
+{
+    struct openxt_kbd_info *info = ring->info;
+    ktime_t event_time = ring->event_time;
+    __u32 cons, span;
+
+    for (cons = start; cons != prod; cons += span) {
+        union oxtkbd_in_event *event = __ring_event(ring, cons);
+        const struct oxtkbd_event_handler *handler = __event_handler(event);
+
+        //Anything that doesn't fit in this pass is left for the main loop
+        //to sort out.
+        span = __event_span(ring, handler, event);
+        if (span > prod - cons)
+            break;
+
+        //Keep track of the backend's time, without updating our estimate
+        //of its clock; the main loop will do that.
+        if (event->type == OXT_KBD_TYPE_TIMESTAMP && ring->have_event_time)
+            ring->event_time = __backend_to_local_time(ring, event->timestamp.timestamp_ns);
+
+        if (event->type != OXT_KBD_TYPE_KEY)
+            continue;
+
+        if (!__is_priority_key(ring, event)) {
+            //Leave every key from the first button on to the main loop.
+            if (__key_route(info, event->key.keycode) == OXT_KBD_ROUTE_POINTER)
+                break;
+            continue;
+        }
+
+        ring->cursor = cons;
+        oxtkbd_stat_inc(info, prioritized_keys);
+        __handle_key_or_button_press(ring, event);
+    }
+
+    ring->event_time = event_time;
+    return cons;
+}
+
+
+/**
+ * Consumes events from the shared ring, passing each to the relevant handler.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param budget The maximum number of events to consume in this pass.
+ *
+ * Must be called with the ring's lock held.
+ *
+ * @return The number of events consumed.
+ */
+static unsigned int __drain_ring(struct oxtkbd_ring *ring, unsigned int budget)
+{
+    struct openxt_kbd_info *info = ring->info;
+    __u32 start, cons, next, prod, avail, priority_end;
+    bool overrun;
+    ktime_t started = ktime_set(0, 0);
+
+    //Get a reference to the shared page used for communications.
+    struct oxtkbd_page *page = ring->page;
+
+    //If we have the latest data from the ringbuffer, we're done!
+    prod = page->in_prod;
+    if (prod == page->in_cons)
+        return 0;
+
+    //Ensure that we always see the latest data.
+    rmb();
+
+    start = page->in_cons;
+    ring->incomplete = false;
+
+    if (collect_stats) {
+        started = ktime_get();
+        oxtkbd_stat_inc(info, passes);
+        oxtkbd_stat_inc(info, occupancy[__hist_bucket(prod - start)]);
+    }
+
+    //If the backend has produced more events than fit in the ring, it's
+    //lapped us, and overwritten events we never saw. Skip past the
+    //overwritten events, release anything that may have been released in
+    //them, and recover using whatever's left.
+    overrun = (prod - start > info->ring_len);
+    if (overrun) {
+        oxtkbd_stat_inc(info, overruns);
+        oxtkbd_stat_add(info, dropped_events, prod - start - info->ring_len);
+        dev_warn_ratelimited(__info_dev(info), "input ring overrun; dropped %u events\n",
+                prod - start - info->ring_len);
+
+        start = prod - info->ring_len;
+        __release_all_inputs(ring);
+    }
+
+    //Never consume more than our budget-- or more than a ring's worth of
+    //events-- in a single pass; anything left over will be picked up by the
+    //next pass.
+    avail  = prod;
+    budget = min(budget, info->ring_len);
+    if (prod - start > budget)
+        prod = start + budget;
+
+    //Decide once per pass whether we're prioritizing keys, which also means
+    //coalescing everything else. If we've just lost events, we stick to
+    //delivering what's left in order.
+    ring->prioritizing = priority_drain && !overrun;
+    ring->coalescing   = coalesce_motion || ring->prioritizing;
+
+    priority_end = start;
+    if (ring->prioritizing)
+        priority_end = __prioritize_keys(ring, start, prod);
+
+    //For each outstanding event in the ringbuffer...
+    for (cons = start; cons != prod; cons = next) {
+        union oxtkbd_in_event *event;
+        const struct oxtkbd_event_handler *handler;
+        unsigned int i, span;
+
+        //Get a reference to the current event, and start fetching the
+        //next one while we handle it.
+        event = __ring_event(ring, cons);
+        if (cons + 1 != prod)
+            prefetch(__ring_event(ring, cons + 1));
+
+        //Work out how many slots the event occupies. A record that can
+        //never fit in the ring is malformed; we skip its first slot, and
+        //make what we can of the rest.
+        handler = __event_handler(event);
+        span = __event_span(ring, handler, event);
+        if (span > info->ring_len) {
+            oxtkbd_stat_inc(info, unknown_events);
+            next = cons + 1;
+            continue;
+        }
+
+        //If it runs past the end of this pass, finish it in this pass if the
+        //backend has produced all of it. Otherwise, stop here, and wait to be
+        //notified of the rest; see __ring_wanted.
+        if (span > prod - cons) {
+            if (span > avail - cons) {
+                ring->incomplete = true;
+                ring->incomplete_until = cons + span;
+                break;
+            }
+            prod = cons + span;
+        }
+        next = cons + span;
+
+        //Trace every slot the event occupies, so the trace can be replayed.
+        ring->cursor = cons;
+        trace_oxtkbd_ring_event(ring->index, &ring->page->in_prod, cons, event);
+        for (i = 1; i < span && trace_oxtkbd_ring_event_enabled(); i++)
+            trace_oxtkbd_ring_event(ring->index, &ring->page->in_prod, cons + i,
+                    __ring_event(ring, cons + i));
+
+        if (event->type < OXT_KBD_STAT_TYPES)
+            oxtkbd_stat_inc(info, events_by_type[event->type]);
+
+        //If we're recovering from an overrun, discard anything stale.
+        if (overrun && !__survives_overrun(event)) {
+            oxtkbd_stat_inc(info, dropped_events);
+            continue;
+        }
+
+        //Ignore anything we don't understand...
+        if (!handler) {
+            oxtkbd_stat_inc(info, unknown_events);
+            continue;
+        }
+
+        //... and anything we've already delivered.
+        if (ring->prioritizing && cons - start < priority_end - start &&
+                __is_priority_key(ring, event))
+            continue;
+
+        //... and discard anything meant for a device we didn't create.
+        if (!__can_deliver(ring, handler->flags)) {
+            oxtkbd_stat_inc(info, undeliverable_events);
+            continue;
+        }
+
+        //Make sure the event isn't reordered against any motion we're
+        //holding, and then handle it.
+        if (handler->flags & OXT_KBD_EV_FLUSH_ALL)
+            __flush_pending_motion(ring);
+        else if (handler->flags & OXT_KBD_EV_FLUSH_ABS)
+            __flush_absolute_motion(ring);
+
+        handler->handle(ring, event);
+    }
+
+    //Deliver any motion we've been holding on to.
+    __flush_pending_motion(ring);
+
+    if (collect_stats) {
+        oxtkbd_stat_add(info, events, cons - start);
+        oxtkbd_stat_inc(info, events_per_pass[__hist_bucket(cons - start)]);
+        oxtkbd_stat_inc(info, pass_duration[__hist_bucket(ktime_to_ns(ktime_sub(ktime_get(), started)))]);
+    }
+
+    //Free the relevant space in the ringbuffer...
+    mb();
+    page->in_cons = cons;
+
+    //... and signal to the other side that we're ready for more data--
+    //if it's told us it's waiting for it.
+    if (info->event_index) {
+        mb();
+        if (!OXT_KBD_NEED_NOTIFY(cons, start, page->in_cons_event))
+            return cons - start;
+    }
+
+    notify_remote_via_irq(ring->irq);
+
+    return cons - start;
+}
+
+
+/**
+ * Asks the backend to notify us of the next event it produces, and then
+ * checks for any events that were produced before it could see our request.
+ * Only meaningful when we're using event indices; otherwise the backend
+ * notifies us of every event regardless.
+ *
+ * @param ring The ring whose events are being handled.
+ *
+ * @return True iff events arrived that we won't otherwise be notified of.
+ */
+static int __ring_final_check(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    if (!info->event_index)
+        return 0;
+
+    ring->page->in_prod_event = __ring_wanted(ring);
+    mb();
+
+    return __ring_has_events(ring);
+}
+
+
+/**
+ * Hands draining of the ring off to our tasklet, masking the event channel
+ * until the tasklet has emptied the ring. If moderation has already masked
+ * the event channel, the tasklet takes over unmasking it.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __defer_drain(struct oxtkbd_ring *ring)
+{
+    if (!ring->moderation_masked)
+        disable_irq_nosync(ring->irq);
+
+    ring->moderation_masked = false;
+    tasklet_schedule(&ring->drain_tasklet);
+}
+
+
+/**
+ * Drains the ring now-- either directly, or by handing off to our tasklet.
+ * Must be called with the ring's lock held, with interrupts disabled.
+ *
+ * @param ring The ring whose events are being handled.
+ *
+ * @return True iff the ring was drained directly; or false if draining has
+ *      been handed off to our tasklet.
+ */
+static bool __drain_now(struct oxtkbd_ring *ring)
+{
+    int passes;
+
+    //If we're deferring our ring processing, hand off to our tasklet.
+    if (deferred_drain) {
+        __defer_drain(ring);
+        return false;
+    }
+
+    //Otherwise, handle every outstanding event right here-- unless the
+    //backend is producing them faster than we can consume them, in which
+    //case we hand off to our tasklet rather than spin in hard-IRQ context.
+    for (passes = 1; ; passes++) {
+        __drain_ring(ring, UINT_MAX);
+
+        if (!__ring_final_check(ring))
+            break;
+
+        if (passes == OXT_KBD_MAX_IRQ_PASSES) {
+            __defer_drain(ring);
+            return false;
+        }
+    }
+
+    if (ring->moderation_masked) {
+        ring->moderation_masked = false;
+        enable_irq(ring->irq);
+    }
+
+    return true;
+}
+
+
+/**
+ * Returns true iff the events waiting on the ring should be handled without
+ * waiting for the current moderation window to close.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static bool __moderation_threshold_reached(struct oxtkbd_ring *ring)
+{
+    __u32 cons, prod, span;
+
+    prod = ring->page->in_prod;
+    rmb();
+
+    //If enough events have queued up, handle them.
+    if (prod - ring->page->in_cons >= max(moderation_events, 1U))
+        return true;
+
+    //Otherwise, handle them only if a key is waiting. We walk the ring a
+    //record at a time, as __drain_ring does, so the later slots of a
+    //multi-slot record are never mistaken for events of their own.
+    for (cons = ring->page->in_cons; cons != prod; cons += span) {
+        union oxtkbd_in_event *event = __ring_event(ring, cons);
+
+        if (event->type == OXT_KBD_TYPE_KEY)
+            return true;
+
+        //A record that hasn't been fully produced is as far as we can see.
+        span = __event_span(ring, __event_handler(event), event);
+        if (span > prod - cons)
+            break;
+    }
+
+    return false;
+}
+
+
+/**
+ * (Re-)arms the moderation timer, which fires at the end of the moderation
+ * window, or at the next key check if the event channel is masked.
+ *
+ * @param ring The ring whose events are being handled.
+ * @param now The current time.
+ *
+ * @return The time at which the timer will fire.
+ */
+static ktime_t __moderation_next_check(struct oxtkbd_ring *ring, ktime_t now)
+{
+    ktime_t expiry = ring->moderation_deadline;
+
+    if (ring->moderation_masked) {
+        ktime_t key_check = ktime_add_us(now, moderation_key_us);
+
+        if (ktime_before(key_check, expiry))
+            expiry = key_check;
+    }
+
+    return expiry;
+}
+
+
+/**
+ * Applies interrupt moderation to a newly-received interrupt.
+ *
+ * @param ring The ring whose events are being handled.
+ *
+ * @return True iff handling of the ring has been deferred to the moderation
+ *      timer; or false if the ring should be drained now.
+ */
+static bool __moderate(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+    ktime_t now;
+
+    //If we're using event indices, and not masking the event channel,
+    //make sure the backend keeps notifying us while the window is open--
+    //otherwise we'd never see a key event until the window closes.
+    if (info->event_index && !ring->moderation_masked) {
+        ring->page->in_prod_event = ring->page->in_prod + 1;
+        mb();
+    }
+
+    //If a window is already open, close it early if there's something
+    //that can't wait.
+    if (ring->moderating) {
+        if (__moderation_threshold_reached(ring))
+            hrtimer_start(&ring->moderation_timer, ktime_set(0, 0), HRTIMER_MODE_REL_PINNED);
+        return true;
+    }
+
+    //If there's something here that can't wait, don't open a window at all.
+    if (__moderation_threshold_reached(ring))
+        return false;
+
+    //Otherwise, open a new moderation window.
+    now = ktime_get();
+    ring->moderating = true;
+    ring->moderation_deadline = ktime_add_us(now, moderation_motion_us);
+
+    if (moderation_key_us) {
+        disable_irq_nosync(ring->irq);
+        ring->moderation_masked = true;
+    }
+
+    hrtimer_start(&ring->moderation_timer, __moderation_next_check(ring, now),
+            HRTIMER_MODE_ABS_PINNED);
+    return true;
+}
+
+
+/**
+ * Moderation timer handler: closes the moderation window once it's expired,
+ * or once there's an event waiting that can't wait for it to expire.
+ */
+static enum hrtimer_restart input_moderation_timer(struct hrtimer *timer)
+{
+    struct oxtkbd_ring *ring =
+        container_of(timer, struct oxtkbd_ring, moderation_timer);
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    spin_lock_irqsave(&ring->lock, flags);
+
+    //If the window is still open, and nothing needs handling yet,
+    //check back later.
+    if (ktime_before(now, ring->moderation_deadline) &&
+            !__moderation_threshold_reached(ring)) {
+        hrtimer_set_expires(timer, __moderation_next_check(ring, now));
+        restart = HRTIMER_RESTART;
+    }
+    else {
+        ring->moderating = false;
+        __drain_now(ring);
+    }
+
+    spin_unlock_irqrestore(&ring->lock, flags);
+    return restart;
+}
+
+
+/**
+ * Stops the backend from notifying us of new events while we're polling
+ * for them.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __suppress_notifications(struct oxtkbd_ring *ring)
+{
+    struct openxt_kbd_info *info = ring->info;
+
+    if (info->event_index) {
+        ring->page->in_prod_event = ring->page->in_cons + OXT_KBD_POLL_EVENT_OFFSET;
+        mb();
+        return;
+    }
+
+    if (!ring->poll_masked) {
+        disable_irq_nosync(ring->irq);
+        ring->poll_masked = true;
+    }
+}
+
+
+/**
+ * Opens a busy polling window on a ring that has just been drained.
+ * Must be called with the ring's lock held.
+ *
+ * @param ring The ring whose events are being handled.
+ */
+static void __start_polling(struct oxtkbd_ring *ring)
+{
+    ring->polling = true;
+    ring->poll_deadline = ktime_add_us(ktime_get(), busy_poll_us);
+    __suppress_notifications(ring);
+
+    oxtkbd_stat_inc(ring->info, poll_windows);
+    hrtimer_start(&ring->poll_timer,
+            ktime_set(0, max(busy_poll_interval_us, 1U) * NSEC_PER_USEC),
+            HRTIMER_MODE_REL_PINNED);
+}
+
+
+/**
+ * Poll timer handler: drains any events that have arrived since the last
+ * poll, and closes the polling window once the ring has gone idle.
+ */
+static enum hrtimer_restart input_poll_timer(struct hrtimer *timer)
+{
+    struct oxtkbd_ring *ring =
+        container_of(timer, struct oxtkbd_ring, poll_timer);
+    ktime_t interval = ktime_set(0, max(busy_poll_interval_us, 1U) * NSEC_PER_USEC);
+    ktime_t now = ktime_get();
+    enum hrtimer_restart restart = HRTIMER_RESTART;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ring->lock, flags);
+
+    if (__ring_has_events(ring)) {
+        oxtkbd_stat_inc(ring->info, productive_polls);
+        __drain_ring(ring, UINT_MAX);
+        ring->poll_deadline = ktime_add_us(now, busy_poll_us);
+    }
+
+    //If the ring's been busy recently, keep polling.
+    if (busy_poll && ktime_before(now, ring->poll_deadline))
+        goto out;
+
+    //Otherwise, go back to waiting for interrupts. If we'd masked our event
+    //channel, any event that arrived since our last poll is still pending on
+    //it, and will fire as soon as we unmask.
+    ring->polling = false;
+    if (ring->poll_masked) {
+        ring->poll_masked = false;
+        enable_irq(ring->irq);
+        restart = HRTIMER_NORESTART;
+        goto out;
+    }
+
+    //If events arrived before the backend could see we're waiting for them,
+    //we won't be notified of them; so keep polling.
+    if (__ring_final_check(ring)) {
+        ring->polling = true;
+        ring->poll_deadline = ktime_add_us(now, busy_poll_us);
+        __suppress_notifications(ring);
+        goto out;
+    }
+
+    restart = HRTIMER_NORESTART;
+
+ out:
+    if (restart == HRTIMER_RESTART)
+        hrtimer_forward_now(timer, interval);
+
+    spin_unlock_irqrestore(&ring->lock, flags);
+    return restart;
+}
+
+
+/**
+ * Main handler for OpenXT PV input.
+ */
+static irqreturn_t input_handler(int rq, void *dev_id)
+{
+    //Get a reference to the ring that needs attention...
+    struct oxtkbd_ring *ring = dev_id;
+
+    oxtkbd_stat_inc(ring->info, interrupts);
+    trace_oxtkbd_interrupt(ring->index, &ring->page->in_prod, &ring->page->in_cons);
+
+    spin_lock(&ring->lock);
+
+    //If we're busy polling, the poll timer will pick up whatever we've been
+    //notified of. (We can be notified while polling if the backend decided
+    //to notify us just before we asked it not to.)
+    if (ring->polling)
+        goto out;
+
+    //If we're moderating interrupts, and we can afford to wait for more
+    //events, let the moderation timer handle the ring.
+    if ((moderation || ring->moderating) && __moderate(ring))
+        goto out;
+
+    //Drain the ring; and if we're busy polling, keep an eye out for
+    //whatever comes next.
+    if (__drain_now(ring) && busy_poll && !moderation)
+        __start_polling(ring);
+
+ out:
+    spin_unlock(&ring->lock);
+    return IRQ_HANDLED;
+}
+
+
+/**
+ * Deferred handler for OpenXT PV input. Runs with the event channel
+ * masked, and consumes at most drain_budget events per pass.
+ *
+ * @param data The ring to be drained.
+ */
+static void input_drain_tasklet(unsigned long data)
+{
+    struct oxtkbd_ring *ring = (struct oxtkbd_ring *)data;
+    unsigned long flags;
+
+    //Our budget bounds how long we hold the lock-- and so, how long we keep
+    //interrupts masked on this CPU.
+    spin_lock_irqsave(&ring->lock, flags);
+    __drain_ring(ring, max(drain_budget, 1));
+
+    //If the backend still has events waiting for us, yield to the rest of
+    //the system and pick up where we left off on our next pass.
+    if (__ring_has_events(ring) || __ring_final_check(ring)) {
+        spin_unlock_irqrestore(&ring->lock, flags);
+        tasklet_schedule(&ring->drain_tasklet);
+        return;
+    }
+
+    //Otherwise, we've caught up; start accepting interrupts again.
+    //Any event that arrived while we were masked is still pending on
+    //the event channel, and will fire as soon as we unmask.
+    enable_irq(ring->irq);
+    spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+/**
+ * Returns true iff we'd like our devices to accept output for the backend.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static inline bool __wants_output_events(struct openxt_kbd_info *info)
+{
+    return output_events && info->features.output_events;
+}
+
+
+/**
+ * Returns the kinds of output our devices accept, as a mask of
+ * OXT_KBD_OUTPUT_* bits.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static unsigned long __output_kinds(struct openxt_kbd_info *info)
+{
+    unsigned long kinds = 0;
+
+    if (info->keyboard && test_bit(EV_LED, info->keyboard->evbit))
+        kinds |= BIT(OXT_KBD_OUTPUT_LEDS);
+    if (info->absolute_pointer && test_bit(EV_FF, info->absolute_pointer->evbit))
+        kinds |= BIT(OXT_KBD_OUTPUT_RUMBLE);
+
+    return kinds;
+}
+
+
+/**
+ * Returns the out ring slot with the given (free-running) index. The out
+ * ring always lives on ring zero.
+ *
+ * @param info The information structure for the combined input device.
+ * @param idx The index of the slot to be fetched.
+ */
+static inline union oxtkbd_out_event *__out_event(struct openxt_kbd_info *info,
+        __u32 idx)
+{
+    char *slots = (char *)info->rings[0].page + info->out_ring_offs;
+
+    //As with the in ring, only the legacy layout's length isn't a power of two.
+    if (is_power_of_2(info->out_ring_len))
+        idx &= info->out_ring_len - 1;
+    else
+        idx %= info->out_ring_len;
+
+    return (union oxtkbd_out_event *)(slots + idx * OXT_KBD_OUT_EVENT_SIZE);
+}
+
+
+/**
+ * Notes that some output state has changed, and schedules a batch to send
+ * it. Any other output that arrives before the batch runs joins it.
+ *
+ * @param info The information structure for the combined input device.
+ * @param kind The kind of output that's changed.
+ */
+static void __queue_output(struct openxt_kbd_info *info, enum oxtkbd_output_kind kind)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&info->output_lock, flags);
+    __set_bit(kind, &info->output_pending);
+    spin_unlock_irqrestore(&info->output_lock, flags);
+
+    schedule_delayed_work(&info->output_work, 0);
+}
+
+
+/**
+ * Input core callback for output to our keyboard. The input core updates
+ * the keyboard's LED state before calling us, so we need only note that
+ * it's changed. Called with the keyboard's event lock held.
+ *
+ * @param dev The keyboard device.
+ * @param type The type of output event.
+ * @param code The event code, e.g. the LED that's changed.
+ * @param value The event's new value.
+ */
+static int oxtkbd_keyboard_event(struct input_dev *dev, unsigned int type,
+        unsigned int code, int value)
+{
+    struct openxt_kbd_info *info = input_get_drvdata(dev);
+
+    if (type != EV_LED)
+        return -EINVAL;
+
+    __queue_output(info, OXT_KBD_OUTPUT_LEDS);
+    return 0;
+}
+
+
+#if IS_ENABLED(CONFIG_INPUT_FF_MEMLESS)
+/**
+ * Memoryless force-feedback callback for our absolute pointer, giving the
+ * combined rumble effect it should now be playing. Called with the
+ * pointer's event lock held.
+ *
+ * @param dev The absolute pointer device.
+ * @param data Unused.
+ * @param effect The effect to be played.
+ */
+static int oxtkbd_play_effect(struct input_dev *dev, void *data,
+        struct ff_effect *effect)
+{
+    struct openxt_kbd_info *info = input_get_drvdata(dev);
+    unsigned long flags;
+
+    if (effect->type != FF_RUMBLE)
+        return 0;
+
+    spin_lock_irqsave(&info->output_lock, flags);
+    info->rumble_strong = effect->u.rumble.strong_magnitude;
+    info->rumble_weak   = effect->u.rumble.weak_magnitude;
+    spin_unlock_irqrestore(&info->output_lock, flags);
+
+    __queue_output(info, OXT_KBD_OUTPUT_RUMBLE);
+    return 0;
+}
+#endif
+
+
+/**
+ * Sends any output state waiting to be sent to the backend, as one batch
+ * with one notification. Each output event carries complete state, so
+ * however many changes were made before we ran, only the latest state is
+ * sent; anything that doesn't fit in the out ring is retried shortly.
+ *
+ * @param work The output work of the device whose output is to be sent.
+ */
+static void oxtkbd_output_work(struct work_struct *work)
+{
+    struct openxt_kbd_info *info = container_of(to_delayed_work(work),
+            struct openxt_kbd_info, output_work);
+    struct oxtkbd_page *page;
+    unsigned long flags;
+    __u32 start, prod, cons;
+    int kind;
+
+    spin_lock_irqsave(&info->output_lock, flags);
+
+    //If the backend isn't listening, we'll send our state once it is.
+    if (!info->output_connected)
+        goto out;
+
+    page  = info->rings[0].page;
+    start = prod = page->out_prod;
+    cons  = READ_ONCE(page->out_cons);
+
+    //Ensure we don't reuse any slot before the backend's finished with it.
+    mb();
+
+    for (kind = 0; kind < OXT_KBD_OUTPUT_KINDS && prod - cons < info->out_ring_len; kind++) {
+        union oxtkbd_out_event *event;
+
+        if (!test_bit(kind, &info->output_pending))
+            continue;
+
+        __clear_bit(kind, &info->output_pending);
+        event = __out_event(info, prod++);
+        memset(event, 0, sizeof(*event));
+
+        switch (kind) {
+
+        case OXT_KBD_OUTPUT_LEDS:
+            event->led.type = OXT_KBD_OUT_TYPE_LED;
+            event->led.leds = READ_ONCE(info->keyboard->led[0]);
+            break;
+
+        case OXT_KBD_OUTPUT_RUMBLE:
+            event->rumble.type   = OXT_KBD_OUT_TYPE_RUMBLE;
+            event->rumble.strong = info->rumble_strong;
+            event->rumble.weak   = info->rumble_weak;
+            break;
+        }
+    }
+
+    //Publish the whole batch, and let the backend know about it.
+    if (prod != start) {
+        wmb();
+        page->out_prod = prod;
+        notify_remote_via_irq(info->rings[0].irq);
+
+        oxtkbd_stat_add(info, output_events, prod - start);
+        oxtkbd_stat_inc(info, output_batches);
+    }
+
+    //Anything left is waiting for space in the out ring.
+    if (info->output_pending)
+        schedule_delayed_work(&info->output_work, msecs_to_jiffies(OXT_KBD_OUTPUT_RETRY_MS));
+
+ out:
+    spin_unlock_irqrestore(&info->output_lock, flags);
+}
+
+
+/**
+ * Starts sending output to a newly-connected backend, beginning with our
+ * current state, which it won't otherwise know.
+ *
+ * @param info The information structure for the connected device.
+ */
+static void __start_output(struct openxt_kbd_info *info)
+{
+    unsigned long flags;
+
+    if (!info->output_events)
+        return;
+
+    spin_lock_irqsave(&info->output_lock, flags);
+    info->output_connected = true;
+    info->output_pending  |= __output_kinds(info);
+    spin_unlock_irqrestore(&info->output_lock, flags);
+
+    schedule_delayed_work(&info->output_work, 0);
+}
+
+
+/**
+ * Stops sending output to the backend, waiting for any batch being sent.
+ * Output that arrives from here on is held until we're connected again.
+ *
+ * @param info The information structure for the device being disconnected.
+ */
+static void __stop_output(struct openxt_kbd_info *info)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&info->output_lock, flags);
+    info->output_connected = false;
+    spin_unlock_irqrestore(&info->output_lock, flags);
+
+    cancel_delayed_work_sync(&info->output_work);
+}
+
+
+/**
+ * Determines which keymap profile our keyboard should use: the one given
+ * by our module parameter, or if that's "auto", the one the backend asked
+ * for.
+ *
+ * @param info The information structure for the combined input device.
+ *
+ * @return The keymap profile to use.
+ */
+static const struct oxtkbd_keymap_profile *__select_keymap(struct openxt_kbd_info *info)
+{
+    int i;
+    const char *name = keymap;
+
+    if (!strcmp(name, "auto"))
+        name = info->features.keymap[0] ? info->features.keymap : "full";
+
+    for (i = 0; i < ARRAY_SIZE(oxtkbd_keymap_profiles); i++)
+        if (!strcmp(name, oxtkbd_keymap_profiles[i].name))
+            return &oxtkbd_keymap_profiles[i];
+
+    //Benchmark devices have no xenbus device to warn about.
+    if (info->xbdev)
+        dev_warn(&info->xbdev->dev, "unknown keymap profile \"%s\"; using \"full\"\n", name);
+    return &oxtkbd_keymap_profiles[0];
+}
+
+
+/**
+ * Creates a new Xen Virtual Keyboard Device.
+ *
+ * @param info The information structure for the combined input device
+ *      for which this device should belong to.
+ * @param name The new device's name, as reported to the user.
+ */
+static struct input_dev * __allocate_keyboard_device(struct openxt_kbd_info *info,
+        char * name)
+{
+    int i, code;
+    const struct oxtkbd_keymap_profile *profile = __select_keymap(info);
+
+    //Allocate a new input device.
+    struct input_dev *kbd = input_allocate_device();
+    if (!kbd)
+        return NULL;
+
+    //Initailize its basic device information...
+    kbd->name       = name;
+    kbd->phys       = info->phys;
+    kbd->id.bustype = BUS_PCI;
+    kbd->id.vendor  = 0x5853;
+    kbd->id.product = 0xffff;
+
+    //Register all of the keys we'll want the keyboard device to handle.
+    //Keys outside of our profile won't be routed anywhere, so they'll be
+    //dropped on arrival.
+    __set_bit(EV_KEY, kbd->evbit);
+    for (i = 0; i < profile->count; i++)
+        for (code = profile->ranges[i].first; code <= profile->ranges[i].last; code++)
+            __set_bit(code, kbd->keybit);
+
+    //If the backend can show our LED state, accept it from the input core.
+    if (__wants_output_events(info)) {
+        __set_bit(EV_LED, kbd->evbit);
+        for (code = LED_NUML; code <= LED_KANA; code++)
+            __set_bit(code, kbd->ledbit);
+
+        input_set_drvdata(kbd, info);
+        kbd->event = oxtkbd_keyboard_event;
+    }
+
+    //The device will be registered with the input subsystem once all of our
+    //devices have been created; see __register_devices.
+    return kbd;
+}
+
+/**
+ * Creates a new Xen Virtrual Pointer Device.
+ *
+ * @param info The information structure for the combined input device
+ *      for which this device should belong to.
+ * @param name The new device's name, as reported to the user.
+ */
+static struct input_dev * __allocate_pointer_device(struct openxt_kbd_info *info,
+        char * name, int is_absolute, int is_multitouch)
+{
+    int i;
+    struct input_dev *ptr = input_allocate_device();
+
+    //If we weren't able to allocate a new input device, fail out!
+    if (!ptr)
+        return NULL;
+
+    //Otherwise, set up some of the device's defaults.
+    ptr->name       = name;
+    ptr->phys       = info->phys;
+    ptr->id.bustype = BUS_PCI;
+    ptr->id.vendor  = 0x5853;
+    ptr->id.product = 0xfffe;
+
+    //If we're creating an absolute device, register it as a provider
+    //of absolute events.
+    if (is_absolute) {
+        __set_bit(EV_ABS, ptr->evbit);
+        input_set_abs_params(ptr, ABS_X, 0, default_max_x, 0, 0);
+        input_set_abs_params(ptr, ABS_Y, 0, default_max_y, 0, 0);
+
+        if (is_multitouch) {
+            input_set_abs_params(ptr, ABS_MT_POSITION_X, 0, default_max_x, 0, 0);
+            input_set_abs_params(ptr, ABS_MT_POSITION_Y, 0, default_max_y, 0, 0);
+
+            //Accept touches, as well.
+            input_set_capability(ptr, EV_KEY, BTN_TOUCH);
+
+            //And allow as many fingers of touch as the backend can report.
+            if (input_mt_init_slots(ptr, info->touch_slot_count, INPUT_MT_DIRECT)) {
+                input_free_device(ptr);
+                return NULL;
+            }
+        }
+
+#if IS_ENABLED(CONFIG_INPUT_FF_MEMLESS)
+        //If the backend can play them, accept rumble effects.
+        if (__wants_output_events(info)) {
+            input_set_drvdata(ptr, info);
+            input_set_capability(ptr, EV_FF, FF_RUMBLE);
+            if (input_ff_create_memless(ptr, NULL, oxtkbd_play_effect)) {
+                input_free_device(ptr);
+                return NULL;
+            }
+        }
+#endif
+    }
+    //Otherwise, register it as providing relative ones.
+    else {
+        input_set_capability(ptr, EV_REL, REL_X);
+        input_set_capability(ptr, EV_REL, REL_Y);
+    }
+
+    //Enable scroll events on non-multitouch displays.
+    if (!is_multitouch)
+        input_set_capability(ptr, EV_REL, REL_WHEEL);
+
+    //Mark this device as providing the typical mouse keys. A touchscreen
+    //doesn't get them, or udev would take it for a mouse; buttons that
+    //follow touch motion are delivered via the relative pointer instead.
+    if (!is_multitouch) {
+        __set_bit(EV_KEY, ptr->evbit);
+        for (i = BTN_LEFT; i <= BTN_TASK; i++)
+            __set_bit(i, ptr->keybit);
+    }
+
+    return ptr;
+}
+
+/**
+ * Prints a single log2 histogram to a debugfs file.
+ *
+ * @param m The seq_file to print to.
+ * @param name The name of the histogram.
+ * @param hist The histogram's buckets.
+ */
+static void __show_histogram(struct seq_file *m, const char *name, const u64 *hist)
+{
+    int i;
+
+    seq_printf(m, "%s:\n", name);
+    for (i = 0; i < OXT_KBD_HIST_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+
+        if (i == 0)
+            seq_printf(m, "  %10u: %llu\n", 0, hist[i]);
+        else
+            seq_printf(m, "  %10llu: %llu\n", 1ULL << (i - 1), hist[i]);
+    }
+}
+
+
+/**
+ * Shows the statistics for a given device, summed across every CPU.
+ */
+static int oxtkbd_stats_show(struct seq_file *m, void *unused)
+{
+    int cpu, i, j;
+    struct openxt_kbd_info *info = m->private;
+    struct oxtkbd_stats total;
+    u64 *sum = (u64 *)&total;
+
+    memset(&total, 0, sizeof(total));
+    for_each_possible_cpu(cpu) {
+        u64 *count = (u64 *)per_cpu_ptr(info->stats, cpu);
+
+        for (i = 0; i < sizeof(total) / sizeof(u64); i++)
+            sum[i] += count[i];
+    }
+
+    seq_printf(m, "interrupts: %llu\n", total.interrupts);
+    seq_printf(m, "passes: %llu\n", total.passes);
+    seq_printf(m, "poll_windows: %llu\n", total.poll_windows);
+    seq_printf(m, "productive_polls: %llu\n", total.productive_polls);
+    seq_printf(m, "prioritized_keys: %llu\n", total.prioritized_keys);
+    seq_printf(m, "output_events: %llu\n", total.output_events);
+    seq_printf(m, "output_batches: %llu\n", total.output_batches);
+    seq_printf(m, "events: %llu\n", total.events);
+    seq_printf(m, "unknown_events: %llu\n", total.unknown_events);
+    seq_printf(m, "unknown_keycodes: %llu\n", total.unknown_keycodes);
+    seq_printf(m, "unmapped_contacts: %llu\n", total.unmapped_contacts);
+    seq_printf(m, "undeliverable_events: %llu\n", total.undeliverable_events);
+    seq_printf(m, "overruns: %llu\n", total.overruns);
+    seq_printf(m, "dropped_events: %llu\n", total.dropped_events);
+
+    seq_puts(m, "events_by_type:\n");
+    for (j = 0; j < OXT_KBD_STAT_TYPES; j++)
+        if (total.events_by_type[j])
+            seq_printf(m, "  %10d: %llu\n", j, total.events_by_type[j]);
+
+    __show_histogram(m, "events_per_pass", total.events_per_pass);
+    __show_histogram(m, "pass_duration_ns", total.pass_duration);
+    __show_histogram(m, "occupancy", total.occupancy);
+    __show_histogram(m, "latency_ns", total.latency);
+    return 0;
+}
+
+
+static int oxtkbd_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, oxtkbd_stats_show, inode->i_private);
+}
+
+
+static const struct file_operations oxtkbd_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = oxtkbd_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+
+/**
+ * Builds the key routing table, which maps each keycode onto the device
+ * that should deliver it.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static void __build_key_routes(struct openxt_kbd_info *info)
+{
+    int i;
+
+    memset(info->key_route, 0, sizeof(info->key_route));
+
+    for (i = 0; i < KEY_CNT; i++) {
+        unsigned int route = OXT_KBD_ROUTE_NONE;
+        unsigned int shift = (i % OXT_KBD_ROUTES_PER_BYTE) * OXT_KBD_ROUTE_BITS;
+
+        //Pointer buttons take priority, as the pointers are the more
+        //specific devices. Every pointer with buttons registers the same
+        //ones.
+        if (info->last_pointer && test_bit(i, info->last_pointer->keybit))
+            route = OXT_KBD_ROUTE_POINTER;
+        else if (info->keyboard && test_bit(i, info->keyboard->keybit))
+            route = OXT_KBD_ROUTE_KEYBOARD;
+
+        info->key_route[i / OXT_KBD_ROUTES_PER_BYTE] |= route << shift;
+    }
+}
+
+
+/**
+ * Registers a single one of our input devices with the input subsystem.
+ *
+ * @param info The information structure for the combined input device.
+ * @param input The input device to be registered.
+ * @param bit The OXT_KBD_REG_* bit that tracks the device's registration.
+ */
+static void __register_device(struct openxt_kbd_info *info,
+        struct input_dev *input, int bit)
+{
+    int ret = input_register_device(input);
+
+    //A device we can't register just won't be visible to userspace; the
+    //others are still worth having.
+    if (ret) {
+        xenbus_dev_error(info->xbdev, ret, "registering %s", input->name);
+        return;
+    }
+
+    set_bit(bit, &info->registered);
+}
+
+
+/**
+ * Registers each of our input devices with the input subsystem. Runs
+ * asynchronously, so that udev and userspace probing of the new devices
+ * overlaps with our negotiation with the backend.
+ *
+ * @param data The information structure for the combined input device.
+ * @param cookie Unused.
+ */
+static void __register_devices(void *data, async_cookie_t cookie)
+{
+    struct openxt_kbd_info *info = data;
+
+    if (info->keyboard)
+        __register_device(info, info->keyboard, OXT_KBD_REG_KEYBOARD);
+    if (info->relative_pointer)
+        __register_device(info, info->relative_pointer, OXT_KBD_REG_RELATIVE);
+    if (info->absolute_pointer)
+        __register_device(info, info->absolute_pointer, OXT_KBD_REG_ABSOLUTE);
+}
+
+
+/**
+ * Waits for any outstanding registration of our input devices to finish.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static void __wait_for_registration(struct openxt_kbd_info *info)
+{
+    if (info->register_cookie)
+        async_synchronize_cookie_domain(info->register_cookie + 1, &oxtkbd_async_domain);
+}
+
+
+/**
+ * Releases one of our input devices, whether or not it was registered.
+ *
+ * @param info The information structure for the combined input device.
+ * @param input The input device to be released, or NULL.
+ * @param bit The OXT_KBD_REG_* bit that tracks the device's registration.
+ */
+static void __release_device(struct openxt_kbd_info *info,
+        struct input_dev *input, int bit)
+{
+    if (!input)
+        return;
+
+    if (test_bit(bit, &info->registered))
+        input_unregister_device(input);
+    else
+        input_free_device(input);
+}
+
+
+/**
+ * Waits before retrying a xenstore transaction that conflicted with another,
+ * doubling the delay each time, so that many devices starting at once don't
+ * keep conflicting with each other.
+ *
+ * @param delay_ms The delay to wait, which is updated for the next retry.
+ */
+static void __transaction_backoff(unsigned int *delay_ms)
+{
+    msleep(*delay_ms);
+    *delay_ms = min(*delay_ms * 2, (unsigned int)OXT_KBD_MAX_BACKOFF_MS);
+}
+
+
+/**
+ * Reads a boolean feature flag from the backend.
+ *
+ * @param xbt The transaction in which to read the flag.
+ * @param dev The device whose backend should be read.
+ * @param name The name of the feature's node.
+ *
+ * @return True iff the backend advertises the feature.
+ */
+static bool __read_backend_flag(struct xenbus_transaction xbt,
+        struct xenbus_device *dev, const char *name)
+{
+    int val;
+
+    return xenbus_scanf(xbt, dev->otherend, name, "%d", &val) > 0 && val;
+}
+
+
+/**
+ * Returns the ring that carries our pointer events. It's the only ring whose
+ * event path reads our geometry, so its lock also protects our geometry.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static struct oxtkbd_ring *__pointer_ring(struct openxt_kbd_info *info)
+{
+    return &info->rings[(info->ring_count > 1) ? OXT_KBD_POINTER_RING : 0];
+}
+
+
+/**
+ * Reads each of the features and parameters the backend advertises into
+ * our feature cache. These are all read in a single transaction, so we see
+ * a consistent snapshot of the backend's configuration.
+ *
+ * @param dev The device whose backend should be read.
+ * @param info The information structure that corresponds to the given device.
+ *
+ * @return 0 on success, or an error code on failure.
+ */
+static int __read_backend_features(struct xenbus_device *dev,
+        struct openxt_kbd_info *info)
+{
+    int ret, width, height;
+    unsigned int delay_ms = OXT_KBD_MIN_BACKOFF_MS;
+    unsigned long flags;
+    struct xenbus_transaction xbt;
+    struct oxtkbd_backend_features *features = &info->features;
+    struct oxtkbd_ring *ring;
+
+    for (;;) {
+        ret = xenbus_transaction_start(&xbt);
+        if (ret)
+            return ret;
+
+        if (xenbus_scanf(xbt, dev->otherend, "max-ring-page-order", "%d",
+                    &features->max_ring_page_order) <= 0)
+            features->max_ring_page_order = -1;
+        if (xenbus_scanf(xbt, dev->otherend, "max-rings", "%d",
+                    &features->max_rings) <= 0)
+            features->max_rings = 1;
+        if (xenbus_scanf(xbt, dev->otherend, "max-contacts", "%d",
+                    &features->max_contacts) <= 0)
+            features->max_contacts = 0;
+        if (xenbus_scanf(xbt, dev->otherend, "width", "%d", &width) <= 0)
+            width = -1;
+        if (xenbus_scanf(xbt, dev->otherend, "height", "%d", &height) <= 0)
+            height = -1;
+
+        if (xenbus_scanf(xbt, dev->otherend, "feature-abs-pointer", "%d",
+                    &features->abs_pointer) <= 0)
+            features->abs_pointer = -1;
+        if (xenbus_scanf(xbt, dev->otherend, "feature-multi-touch", "%d",
+                    &features->multi_touch) <= 0)
+            features->multi_touch = -1;
+
+        if (xenbus_scanf(xbt, dev->otherend, "keymap-profile", "%15s",
+                    features->keymap) <= 0)
+            features->keymap[0] = '\0';
+
+        features->disable_keyboard = __read_backend_flag(xbt, dev, "feature-disable-keyboard");
+        features->disable_pointer  = __read_backend_flag(xbt, dev, "feature-disable-pointer");
+        features->compact_events = __read_backend_flag(xbt, dev, "feature-compact-events");
+        features->event_index    = __read_backend_flag(xbt, dev, "feature-event-index");
+        features->timestamps     = __read_backend_flag(xbt, dev, "feature-timestamps");
+        features->touch_batches  = __read_backend_flag(xbt, dev, "feature-touch-batch");
+        features->output_events  = __read_backend_flag(xbt, dev, "feature-output-events");
+        features->ring_offset    = __read_backend_flag(xbt, dev, "feature-ring-offset");
+
+        //We've only read, so we can just check whether our snapshot was
+        //consistent-- and retry if it wasn't.
+        ret = xenbus_transaction_end(xbt, 0);
+        if (ret != -EAGAIN)
+            break;
+
+        __transaction_backoff(&delay_ms);
+    }
+
+    if (ret)
+        return ret;
+
+    //If we're resuming, the event path may be using our geometry; so we
+    //only change it under the pointer ring's lock.
+    ring = __pointer_ring(info);
+    spin_lock_irqsave(&ring->lock, flags);
+    features->width  = width;
+    features->height = height;
+    spin_unlock_irqrestore(&ring->lock, flags);
+
+    return 0;
+}
+
+
+/**
+ * Allocates the state used to track touch contacts, sized to the number of
+ * contacts the backend can report.
+ *
+ * @param dev The XenBus device to which the combined input device belongs.
+ * @param info The information structure for the combined input device.
+ *
+ * @return 0 on success, or an error code on failure.
+ */
+static int __allocate_touch_state(struct xenbus_device *dev,
+        struct openxt_kbd_info *info)
+{
+    //Backends can tell us how many contacts they'll report at once.
+    int count = info->features.max_contacts ? info->features.max_contacts : touch_slots;
+
+    info->touch_slot_count = clamp(count, 1, OXT_KBD_MAX_TOUCH_SLOTS);
+
+    //Keep the contact map at most half full.
+    info->contact_map_bits = ilog2(roundup_pow_of_two(info->touch_slot_count)) + 1;
+
+    info->touch_slots = kcalloc(info->touch_slot_count, sizeof(*info->touch_slots), GFP_KERNEL);
+    info->contact_map = kcalloc(1U << info->contact_map_bits, sizeof(*info->contact_map), GFP_KERNEL);
+    if (!info->touch_slots || !info->contact_map)
+        return -ENOMEM;
+
+    __contact_map_reset(info);
+    return 0;
+}
+
+
+/**
+ * Computes the factor needed to scale one absolute axis from the backend's
+ * span onto ours.
+ *
+ * @param ours The maximum value of our axis.
+ * @param theirs The backend's maximum value on the same axis, or a
+ *      non-positive value if the backend hasn't said.
+ */
+static u32 __abs_scale_factor(int ours, int theirs)
+{
+    if (theirs <= 0)
+        return OXT_KBD_ABS_SCALE_ONE;
+
+    return div_u64((u64)ours << OXT_KBD_ABS_SCALE_SHIFT, theirs);
+}
+
+
+/**
+ * Recomputes our absolute scale factors from the backend's geometry, and
+ * publishes them to the event path. Must be called with the pointer ring's
+ * lock held, unless the rings aren't yet connected.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static void __update_abs_scale(struct openxt_kbd_info *info)
+{
+    u64 x = __abs_scale_factor(default_max_x, info->features.width);
+    u64 y = __abs_scale_factor(default_max_y, info->features.height);
+
+    info->abs_scale = (x << 32) | y;
+}
+
+
+/**
+ * Sets the maximum of one of our absolute axes, in place.
+ *
+ * @param input The device whose axis should be changed.
+ * @param axis The axis to be changed.
+ * @param max Its new maximum.
+ */
+static void __set_abs_max(struct input_dev *input, unsigned int axis, int max)
+{
+    unsigned long flags;
+
+    //The input core updates axes under its event lock, which every event
+    //already takes; so we do the same, and add nothing to the event path.
+    spin_lock_irqsave(&input->event_lock, flags);
+    input_abs_set_max(input, axis, max);
+    spin_unlock_irqrestore(&input->event_lock, flags);
+}
+
+
+/**
+ * Brings our absolute pointer into line with the backend's geometry, as
+ * recorded in our feature cache: either by rescaling positions onto our
+ * fixed axes, or by changing the axes' ranges to match. Must be called with
+ * the pointer ring's lock held.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static void __apply_geometry(struct openxt_kbd_info *info)
+{
+    struct input_dev *ptr = info->absolute_pointer;
+
+    //If we're scaling absolute positions, our axes never change.
+    if (abs_scaling) {
+        __update_abs_scale(info);
+        return;
+    }
+
+    if (!ptr)
+        return;
+
+    if (info->features.width >= 0) {
+        __set_abs_max(ptr, ABS_X, info->features.width);
+        if (ptr->mt)
+            __set_abs_max(ptr, ABS_MT_POSITION_X, info->features.width);
+    }
+
+    if (info->features.height >= 0) {
+        __set_abs_max(ptr, ABS_Y, info->features.height);
+        if (ptr->mt)
+            __set_abs_max(ptr, ABS_MT_POSITION_Y, info->features.height);
+    }
+}
+
+
+/**
+ * Re-reads the backend's width and height, keeping our current values for
+ * any it doesn't have, and brings our absolute pointer into line with them.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static void __refresh_geometry(struct openxt_kbd_info *info)
+{
+    struct oxtkbd_ring *ring = __pointer_ring(info);
+    unsigned long flags;
+    bool have_width, have_height;
+    int width, height;
+
+    //Reading the store may sleep, so do that before taking the lock.
+    have_width  = xenbus_scanf(XBT_NIL, info->xbdev->otherend, "width", "%d", &width) > 0;
+    have_height = xenbus_scanf(XBT_NIL, info->xbdev->otherend, "height", "%d", &height) > 0;
+
+    //The event path reads our geometry, and resume can change it while
+    //we run; hold the pointer ring's lock so neither sees a partial change.
+    spin_lock_irqsave(&ring->lock, flags);
+
+    if (have_width)
+        info->features.width = width;
+    if (have_height)
+        info->features.height = height;
+
+    __apply_geometry(info);
+
+    spin_unlock_irqrestore(&ring->lock, flags);
+}
+
+
+/**
+ * Handles a change to one of the backend's nodes, picking up any changes
+ * to its width or height-- so a change of resolution takes effect without
+ * a reconnect.
+ *
+ * @param watch The watch that fired.
+ * @param path The path of the node that changed.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static void oxtkbd_geometry_changed(struct xenbus_watch *watch,
+        const char *path, const char *token)
+{
+#else
+static void oxtkbd_geometry_changed(struct xenbus_watch *watch,
+        const char **vec, unsigned int len)
+{
+    const char *path = vec[XS_WATCH_PATH];
+#endif
+    struct openxt_kbd_info *info =
+        container_of(watch, struct openxt_kbd_info, geometry_watch);
+    const char *node = strrchr(path, '/');
+
+    //We watch the whole backend directory; ignore anything but geometry.
+    //The watch fires once for the directory itself when it's registered,
+    //which we take as a change, so we pick up the current geometry.
+    if (strcmp(path, info->xbdev->otherend) &&
+        (!node || (strcmp(node, "/width") && strcmp(node, "/height"))))
+        return;
+
+    __refresh_geometry(info);
+}
+
+
+/**
+ * Re-arms any of a ring's timers that are pending on the current vCPU, so
+ * they follow the ring off the vCPU they were armed on. Run on the ring's
+ * new vCPU, via smp_call_function_single, with interrupts disabled. Each
+ * timer is cancelled and re-armed under the ring's lock, so neither can
+ * drain the ring while it's being moved.
+ *
+ * @param data The ring whose timers should be re-armed.
+ */
+static void __rearm_ring_timers(void *data)
+{
+    struct oxtkbd_ring *ring = data;
+    struct hrtimer *timers[] = { &ring->moderation_timer, &ring->poll_timer };
+    int i, ret;
+
+    for (i = 0; i < ARRAY_SIZE(timers); i++) {
+        for (;;) {
+            spin_lock(&ring->lock);
+
+            //If the timer's callback is running, it's waiting for our lock;
+            //let it finish, and then try again.
+            ret = hrtimer_try_to_cancel(timers[i]);
+            if (ret >= 0)
+                break;
+
+            spin_unlock(&ring->lock);
+            cpu_relax();
+        }
+
+        //Like everywhere else we arm them, keep the timers pinned, now to
+        //the vCPU we're running on.
+        if (ret)
+            hrtimer_start(timers[i], hrtimer_get_expires(timers[i]), HRTIMER_MODE_ABS_PINNED);
+
+        spin_unlock(&ring->lock);
+    }
+}
+
+
+/**
+ * Steers a ring's event channel to the vCPU it's meant to be handled on.
+ * Xen event channels are bound to a single vCPU, so the affinity we set
+ * here rebinds the event channel itself.
+ *
+ * @param ring The ring whose event channel should be steered.
+ *
+ * @return int Zero on success, or an error code on failure.
+ */
+static int __steer_ring(struct oxtkbd_ring *ring)
+{
+    int ret;
+
+    if (ring->irq < 0)
+        return 0;
+
+    //To let Xen choose again, we have to give the event channel its default
+    //affinity back; dropping our hint alone would leave it where it is. Any
+    //pending timers finish their current window where they are; the next
+    //one is armed from the event channel's new vCPU.
+    if (ring->cpu < 0) {
+        ret = irq_set_affinity_hint(ring->irq, NULL);
+        return ret ? ret : irq_set_affinity(ring->irq, cpu_online_mask);
+    }
+
+    if (ring->cpu >= nr_cpu_ids || !cpu_online(ring->cpu))
+        return -EINVAL;
+
+    ret = irq_set_affinity_hint(ring->irq, cpumask_of(ring->cpu));
+    if (ret)
+        return ret;
+
+    //Move any pending timers along with the event channel, arming them from
+    //its new vCPU so they stay pinned.
+    return smp_call_function_single(ring->cpu, __rearm_ring_timers, ring, true);
+}
+
+
+/**
+ * Shows the vCPU that handles each of a device's rings, in ring order.
+ */
+static ssize_t irq_cpu_show(struct device *dev, struct device_attribute *attr,
+        char *buf)
+{
+    struct openxt_kbd_info *info = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s%d",
+                i ? " " : "", info->rings[i].cpu);
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    return len;
+}
+
+
+/**
+ * Changes the vCPU that handles each of a device's rings. Accepts one vCPU
+ * per ring, in ring order, or -1 to let Xen choose; rings that aren't
+ * listed keep their current vCPU.
+ */
+static ssize_t irq_cpu_store(struct device *dev, struct device_attribute *attr,
+        const char *buf, size_t count)
+{
+    struct openxt_kbd_info *info = dev_get_drvdata(dev);
+    int cpus[OXT_KBD_MAX_RINGS];
+    int i, n, ret = 0;
+
+    BUILD_BUG_ON(OXT_KBD_MAX_RINGS != 2);
+    n = sscanf(buf, "%d %d", &cpus[0], &cpus[1]);
+    if (n <= 0)
+        return -EINVAL;
+
+    for (i = 0; i < n; i++)
+        if (cpus[i] < -1 || cpus[i] >= (int)nr_cpu_ids || (cpus[i] >= 0 && !cpu_online(cpus[i])))
+            return -EINVAL;
+
+    //Keep each ring's IRQ stable while we steer it.
+    mutex_lock(&info->irq_lock);
+    for (i = 0; i < n; i++) {
+        int err;
+
+        info->rings[i].cpu = cpus[i];
+        err = __steer_ring(&info->rings[i]);
+        if (err)
+            ret = err;
+    }
+    mutex_unlock(&info->irq_lock);
+
+    return ret ? ret : count;
+}
+
+static DEVICE_ATTR_RW(irq_cpu);
+
+
+/**
+ * Returns the mirror's tag for one of our devices.
+ *
+ * @param info The information structure for the combined input device.
+ * @param dev One of the device's input devices.
+ */
+static inline u16 __mirror_device(struct openxt_kbd_info *info, struct input_dev *dev)
+{
+    if (dev == info->keyboard)
+        return OXT_KBD_MIRROR_KEYBOARD;
+    if (dev == info->relative_pointer)
+        return OXT_KBD_MIRROR_RELATIVE;
+
+    return OXT_KBD_MIRROR_ABSOLUTE;
+}
+
+
+/**
+ * Copies a packet of events from one of our devices into its mirror.
+ * Called by the input core, with the device's event lock held.
+ */
+static void oxtkbd_mirror_events(struct input_handle *handle,
+        const struct input_value *vals, unsigned int count)
+{
+    struct oxtkbd_mirror *mirror = handle->private;
+    struct oxtkbd_mirror_header *shared = mirror->shared;
+    u16 device = __mirror_device(mirror->info, handle->dev);
+    unsigned int i;
+    u32 prod;
+    u64 when;
+
+    //Stamp each record with the time the input core gives the packet, which
+    //is when its input occurred, where we know that; see __sync_device.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+    when = ktime_to_ns(input_get_timestamp(handle->dev)[INPUT_CLK_MONO]);
+#else
+    when = ktime_get_ns();
+#endif
+
+    spin_lock(&mirror->lock);
+
+    prod = shared->prod;
+    for (i = 0; i < count; i++) {
+        struct oxtkbd_mirror_event *record = &mirror->events[(prod + i) & (shared->size - 1)];
+
+        record->time_ns = when;
+        record->device  = device;
+        record->type    = vals[i].type;
+        record->code    = vals[i].code;
+        record->value   = vals[i].value;
+    }
+
+    //Publish the records only once they're complete.
+    smp_wmb();
+    WRITE_ONCE(shared->prod, prod + count);
+
+    spin_unlock(&mirror->lock);
+
+    if (wq_has_sleeper(&mirror->wait))
+        wake_up_interruptible(&mirror->wait);
+}
+
+
+/**
+ * Returns true iff the given input device is one of those our mirror
+ * serves.
+ */
+static bool oxtkbd_mirror_match(struct input_handler *handler, struct input_dev *dev)
+{
+    struct oxtkbd_mirror *mirror = handler->private;
+    struct openxt_kbd_info *info = mirror->info;
+
+    return dev == info->keyboard || dev == info->relative_pointer ||
+        dev == info->absolute_pointer;
+}
+
+
+static int oxtkbd_mirror_connect(struct input_handler *handler, struct input_dev *dev,
+        const struct input_device_id *id)
+{
+    struct input_handle *handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+    int ret;
+
+    if (!handle)
+        return -ENOMEM;
+
+    handle->dev     = dev;
+    handle->handler = handler;
+    handle->name    = handler->name;
+    handle->private = handler->private;
+
+    ret = input_register_handle(handle);
+    if (ret)
+        goto error_free;
+
+    ret = input_open_device(handle);
+    if (ret)
+        goto error_unregister;
+
+    return 0;
+
+ error_unregister:
+    input_unregister_handle(handle);
+ error_free:
+    kfree(handle);
+    return ret;
+}
+
+
+static void oxtkbd_mirror_disconnect(struct input_handle *handle)
+{
+    input_close_device(handle);
+    input_unregister_handle(handle);
+    kfree(handle);
+}
+
+
+//Our handler's match function picks out our own devices.
+static const struct input_device_id oxtkbd_mirror_ids[] = {
+    { .driver_info = 1 },
+    { },
+};
+
+
+static void __mirror_release(struct kref *ref)
+{
+    struct oxtkbd_mirror *mirror = container_of(ref, struct oxtkbd_mirror, ref);
+
+    vfree(mirror->shared);
+    kfree(mirror);
+}
+
+
+static int oxtkbd_mirror_open(struct inode *inode, struct file *file)
+{
+    struct oxtkbd_mirror *mirror =
+        container_of(file->private_data, struct oxtkbd_mirror, misc);
+    struct oxtkbd_mirror_reader *reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+
+    if (!reader)
+        return -ENOMEM;
+
+    //The misc core holds its lock while we're opened, so the mirror can't be
+    //torn down underneath us.
+    kref_get(&mirror->ref);
+    reader->mirror = mirror;
+    reader->seen   = READ_ONCE(mirror->shared->prod);
+    file->private_data = reader;
+
+    return nonseekable_open(inode, file);
+}
+
+
+static int oxtkbd_mirror_release(struct inode *inode, struct file *file)
+{
+    struct oxtkbd_mirror_reader *reader = file->private_data;
+
+    kref_put(&reader->mirror->ref, __mirror_release);
+    kfree(reader);
+    return 0;
+}
+
+
+/**
+ * Waits for records the reader hasn't seen, and then returns the current
+ * value of prod.
+ */
+static ssize_t oxtkbd_mirror_read(struct file *file, char __user *buf,
+        size_t len, loff_t *ppos)
+{
+    struct oxtkbd_mirror_reader *reader = file->private_data;
+    struct oxtkbd_mirror *mirror = reader->mirror;
+    u32 prod;
+    int ret;
+
+    if (len < sizeof(prod))
+        return -EINVAL;
+
+    if ((file->f_flags & O_NONBLOCK) &&
+            READ_ONCE(mirror->shared->prod) == reader->seen && !mirror->dead)
+        return -EAGAIN;
+
+    ret = wait_event_interruptible(mirror->wait,
+            READ_ONCE(mirror->shared->prod) != reader->seen || READ_ONCE(mirror->dead));
+    if (ret)
+        return ret;
+
+    //Once the device has gone away, there's nothing more to wait for.
+    prod = READ_ONCE(mirror->shared->prod);
+    if (prod == reader->seen)
+        return 0;
+
+    if (copy_to_user(buf, &prod, sizeof(prod)))
+        return -EFAULT;
+
+    reader->seen = prod;
+    return sizeof(prod);
+}
+
+
+static __poll_t oxtkbd_mirror_poll(struct file *file, poll_table *wait)
+{
+    struct oxtkbd_mirror_reader *reader = file->private_data;
+    struct oxtkbd_mirror *mirror = reader->mirror;
+    __poll_t mask = 0;
+
+    poll_wait(file, &mirror->wait, wait);
+
+    if (READ_ONCE(mirror->shared->prod) != reader->seen)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (READ_ONCE(mirror->dead))
+        mask |= EPOLLHUP;
+
+    return mask;
+}
+
+
+/**
+ * Maps the mirror's shared area, which readers may never write.
+ */
+static int oxtkbd_mirror_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct oxtkbd_mirror_reader *reader = file->private_data;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    return remap_vmalloc_range(vma, reader->mirror->shared, vma->vm_pgoff);
+}
+
+
+static const struct file_operations oxtkbd_mirror_fops = {
+    .owner   = THIS_MODULE,
+    .open    = oxtkbd_mirror_open,
+    .release = oxtkbd_mirror_release,
+    .read    = oxtkbd_mirror_read,
+    .poll    = oxtkbd_mirror_poll,
+    .mmap    = oxtkbd_mirror_mmap,
+    .llseek  = no_llseek,
+};
+
+
+/**
+ * Creates a device's input mirror, and starts feeding it from the device's
+ * input devices as they're registered.
+ *
+ * @param info The information structure for the combined input device.
+ *
+ * @return Zero on success, or an error code on failure.
+ */
+static int __create_mirror(struct openxt_kbd_info *info)
+{
+    struct oxtkbd_mirror *mirror = kzalloc(sizeof(*mirror), GFP_KERNEL);
+    unsigned int size = roundup_pow_of_two(clamp(mirror_events, 64, 1 << 20));
+    int ret;
+
+    if (!mirror)
+        return -ENOMEM;
+
+    kref_init(&mirror->ref);
+    spin_lock_init(&mirror->lock);
+    init_waitqueue_head(&mirror->wait);
+    mirror->info = info;
+
+    //Readers map the whole shared area, so it has to be page-granular.
+    mirror->shared_size = PAGE_ALIGN(OXT_KBD_MIRROR_EVENTS_OFFSET +
+            size * sizeof(struct oxtkbd_mirror_event));
+    mirror->shared = vmalloc_user(mirror->shared_size);
+    if (!mirror->shared) {
+        kfree(mirror);
+        return -ENOMEM;
+    }
+
+    mirror->events = (void *)((char *)mirror->shared + OXT_KBD_MIRROR_EVENTS_OFFSET);
+    mirror->shared->version = OXT_KBD_MIRROR_VERSION;
+    mirror->shared->size    = size;
+
+    mirror->handler.private    = mirror;
+    mirror->handler.events     = oxtkbd_mirror_events;
+    mirror->handler.match      = oxtkbd_mirror_match;
+    mirror->handler.connect    = oxtkbd_mirror_connect;
+    mirror->handler.disconnect = oxtkbd_mirror_disconnect;
+    mirror->handler.name       = mirror->name;
+    mirror->handler.id_table   = oxtkbd_mirror_ids;
+
+    snprintf(mirror->name, sizeof(mirror->name), "oxtkbd-%s", dev_name(&info->xbdev->dev));
+    mirror->misc.minor  = MISC_DYNAMIC_MINOR;
+    mirror->misc.name   = mirror->name;
+    mirror->misc.fops   = &oxtkbd_mirror_fops;
+    mirror->misc.parent = &info->xbdev->dev;
+
+    ret = input_register_handler(&mirror->handler);
+    if (ret)
+        goto error_put;
+
+    ret = misc_register(&mirror->misc);
+    if (ret)
+        goto error_unregister;
+
+    info->mirror = mirror;
+    return 0;
+
+ error_unregister:
+    input_unregister_handler(&mirror->handler);
+ error_put:
+    kref_put(&mirror->ref, __mirror_release);
+    return ret;
+}
+
+
+/**
+ * Stops feeding a device's input mirror, and lets go of it. Any remaining
+ * readers keep the mirror until they close it, but see no new records.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static void __destroy_mirror(struct openxt_kbd_info *info)
+{
+    struct oxtkbd_mirror *mirror = info->mirror;
+
+    if (!mirror)
+        return;
+
+    misc_deregister(&mirror->misc);
+    input_unregister_handler(&mirror->handler);
+
+    WRITE_ONCE(mirror->dead, true);
+    wake_up_interruptible(&mirror->wait);
+
+    info->mirror = NULL;
+    kref_put(&mirror->ref, __mirror_release);
+}
+
+
+/**
+ * Returns true iff the backend will drive an absolute pointer.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static bool __wants_absolute_pointer(struct openxt_kbd_info *info)
+{
+    struct oxtkbd_backend_features *features = &info->features;
+
+    if (features->disable_pointer)
+        return false;
+
+    //Backends that don't tell us drive everything.
+    if (features->abs_pointer < 0 && features->multi_touch < 0)
+        return true;
+
+    return features->abs_pointer > 0 || features->multi_touch > 0;
+}
+
+
+/**
+ * Returns true iff the backend will deliver touch contacts.
+ *
+ * @param info The information structure for the combined input device.
+ */
+static bool __wants_multi_touch(struct openxt_kbd_info *info)
+{
+    return info->features.multi_touch != 0;
+}
+
+
+/**
+ * Creates a new OpenXT combined input device, if possible.
+ *
+ * @param dev The XenBus device to which the new combined input device will belong.
+ * @param id Information regarding the relevant xenbus device.
+ *
+ * @return 0 on success, or an error code on failure.
+ */
+static int oxtkbd_probe(struct xenbus_device *dev, const struct xenbus_device_id *id)
+{
+    int i, ret;
+    struct openxt_kbd_info *info;
+
+    //Create a new information structure for our new combined input device.
+    //This will represent the device "object", and store all of the device's
+    //state.
+    info = kmem_cache_zalloc(oxtkbd_info_cache, GFP_KERNEL);
+    if (!info) {
+        xenbus_dev_fatal(dev, -ENOMEM, "allocating info structure");
+        return -ENOMEM;
+    }
+
+    //Associate the new information structure with the core XenBus device.
+    dev_set_drvdata(&dev->dev, info);
+
+    //Initialize the information structure.
+    info->xbdev = dev;
+    mutex_init(&info->irq_lock);
+    spin_lock_init(&info->output_lock);
+    INIT_DELAYED_WORK(&info->output_work, oxtkbd_output_work);
+    snprintf(info->phys, sizeof(info->phys), "xenbus/%s", dev->nodename);
+
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++) {
+        struct oxtkbd_ring *ring = &info->rings[i];
+        int page;
+
+        ring->info  = info;
+        ring->index = i;
+        ring->irq   = -1;
+        ring->cpu   = irq_cpu[i];
+        for (page = 0; page < OXT_KBD_MAX_RING_PAGES; page++)
+            ring->gref[page] = -1;
+
+        spin_lock_init(&ring->lock);
+        tasklet_init(&ring->drain_tasklet, input_drain_tasklet, (unsigned long)ring);
+        hrtimer_init(&ring->moderation_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED);
+        ring->moderation_timer.function = input_moderation_timer;
+        hrtimer_init(&ring->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        ring->poll_timer.function = input_poll_timer;
+    }
+
+    //Set up our statistics, and expose them via debugfs. Failing to create
+    //our debugfs entries is harmless, so we don't check for it.
+    info->stats = alloc_percpu(struct oxtkbd_stats);
+    if (!info->stats)
+        goto error_nomem;
+
+    info->debugfs = debugfs_create_dir(dev_name(&dev->dev), oxtkbd_debugfs_root);
+    debugfs_create_file("stats", S_IRUSR, info->debugfs, info, &oxtkbd_stats_fops);
+
+    //Allow our rings' vCPUs to be changed at runtime.
+    ret = device_create_file(&dev->dev, &dev_attr_irq_cpu);
+    if (ret) {
+        xenbus_dev_fatal(dev, ret, "creating irq_cpu attribute");
+        goto error;
+    }
+
+    //Find out what the backend supports, which determines the shape of the
+    //devices we'll create.
+    ret = __read_backend_features(dev, info);
+    if (ret) {
+        xenbus_dev_fatal(dev, ret, "reading backend features");
+        goto error;
+    }
+
+    //Every device we create costs the guest an evdev node and a round of
+    //udev and userspace probing, so only create the devices the backend
+    //will actually drive.
+
+    //Allocate a new keyboard device, which will handle all keypresses and
+    //button presses.
+    if (!info->features.disable_keyboard) {
+        info->keyboard = __allocate_keyboard_device(info, "Xen Virtual Keyboard");
+        if (!info->keyboard)
+            goto error_nomem;
+    }
+
+    //Allocate a new relative pointer, for our relative events...
+    if (!info->features.disable_pointer) {
+        info->relative_pointer = __allocate_pointer_device(info, "Xen Relative Pointer", false, false);
+        if (!info->relative_pointer)
+            goto error_nomem;
+    }
+
+    //...and an absolute pointer for our absolute ones, which can track as
+    //many touch contacts as the backend says it can report.
+    ret = __allocate_touch_state(dev, info);
+    if (ret)
         goto error_nomem;
 
-    //Allocate a new keyboard device, which will handle all keypresses and
-    //button presses.
-    info->keyboard = __allocate_keyboard_device(info, "Xen Virtual Keyboard");
-    if (!info->keyboard)
-        goto error_nomem;
+    if (__wants_absolute_pointer(info)) {
+        info->absolute_pointer = __allocate_pointer_device(info, "Xen Absolute Pointer",
+                true, __wants_multi_touch(info));
+        if (!info->absolute_pointer)
+            goto error_nomem;
+    }
+
+    //Now that we know what each device can deliver, work out where each
+    //key should go. Until something moves, pointer buttons go via the
+    //relative pointer, if we have one.
+    if (info->relative_pointer)
+        info->last_pointer = info->relative_pointer;
+    else if (__has_pointer_buttons(info->absolute_pointer))
+        info->last_pointer = info->absolute_pointer;
+    else
+        info->last_pointer = NULL;
+    __build_key_routes(info);
+    info->deduplicating_touches = __wants_touch_dedupe();
+
+    //If we're mirroring our input, set up the mirror before we register
+    //our devices, so it sees every event they deliver.
+    if (input_mirror) {
+        ret = __create_mirror(info);
+        if (ret) {
+            xenbus_dev_fatal(dev, ret, "creating input mirror");
+            goto error;
+        }
+    }
+
+    //Register our devices in the background, while we connect. The backend
+    //won't send any events until we've finished registering, as we wait for
+    //registration before we tell it we're connected.
+    info->register_cookie = async_schedule_domain(__register_devices, info, &oxtkbd_async_domain);
+
+    //Follow the backend's geometry as it changes. Registering the watch
+    //fires it once for the backend's directory, which re-reads the
+    //geometry, in case it's changed since we read our features.
+    __update_abs_scale(info);
+    if (info->absolute_pointer) {
+        ret = xenbus_watch_pathfmt(dev, &info->geometry_watch,
+                oxtkbd_geometry_changed, "%s", dev->otherend);
+        if (ret)
+            goto error;
+    }
+
+    //Finally, connect to the backend.
+    ret = oxtkbd_connect_backend(dev, info);
+    if (ret < 0)
+        goto error;
+
+    //Indicate success.
+    return 0;
+
+ error_nomem:
+    ret = -ENOMEM;
+    xenbus_dev_fatal(dev, ret, "allocating device memory");
+ error:
+    oxtkbd_remove(dev);
+    return ret;
+}
+
+/**
+ * Allocates a zeroed ring area from a page shared with other devices on the
+ * same backend, adding a new shared page if all of them are full. We never
+ * share a page between backends, as each area's page is granted to its
+ * device's backend in full.
+ *
+ * @param backend The domain that will be granted access to the area.
+ *
+ * @return The new ring area, or NULL if it couldn't be allocated.
+ */
+static void *__get_shared_area(domid_t backend)
+{
+    struct oxtkbd_shared_page *shared;
+    void *area = NULL;
+    unsigned int slot;
+
+    mutex_lock(&oxtkbd_shared_page_lock);
+
+    list_for_each_entry(shared, &oxtkbd_shared_pages, list) {
+        if (shared->backend != backend)
+            continue;
+
+        slot = find_first_zero_bit(&shared->in_use, OXT_KBD_SHARED_AREAS_PER_PAGE);
+        if (slot < OXT_KBD_SHARED_AREAS_PER_PAGE)
+            goto found;
+    }
+
+    shared = kzalloc(sizeof(*shared), GFP_KERNEL);
+    if (!shared)
+        goto out;
+
+    shared->base = (void *)get_zeroed_page(GFP_KERNEL);
+    if (!shared->base) {
+        kfree(shared);
+        goto out;
+    }
+
+    shared->backend = backend;
+    list_add(&shared->list, &oxtkbd_shared_pages);
+    slot = 0;
+
+ found:
+    __set_bit(slot, &shared->in_use);
+    area = (char *)shared->base + slot * OXT_KBD_SHARED_AREA_SIZE;
+    memset(area, 0, OXT_KBD_SHARED_AREA_SIZE);
+
+ out:
+    mutex_unlock(&oxtkbd_shared_page_lock);
+    return area;
+}
+
+
+/**
+ * Returns a ring area to its shared page, freeing the page once none of its
+ * areas are in use.
+ *
+ * @param area The ring area to be freed.
+ */
+static void __put_shared_area(void *area)
+{
+    struct oxtkbd_shared_page *shared;
+    void *base = (void *)((unsigned long)area & PAGE_MASK);
+
+    mutex_lock(&oxtkbd_shared_page_lock);
 
-    //Allocate a new relative pointer, for our relative events...
-    info->relative_pointer = __allocate_pointer_device(info, "Xen Relative Pointer", false, false);
-    if (!info->relative_pointer)
-        goto error_nomem;
+    list_for_each_entry(shared, &oxtkbd_shared_pages, list) {
+        if (shared->base != base)
+            continue;
 
-    //...and an absolute pointer for our absolute ones.
-    info->absolute_pointer = __allocate_pointer_device(info, "Xen Absolute Pointer", true, true);
-    if (!info->absolute_pointer)
-        goto error_nomem;
+        __clear_bit(offset_in_page(area) / OXT_KBD_SHARED_AREA_SIZE, &shared->in_use);
+        if (!shared->in_use) {
+            list_del(&shared->list);
+            free_page((unsigned long)shared->base);
+            kfree(shared);
+        }
+        break;
+    }
 
-    //Finally, connect to the backend.
-    ret = oxtkbd_connect_backend(dev, info);
-    if (ret < 0)
-        goto error;
+    mutex_unlock(&oxtkbd_shared_page_lock);
+}
+
+
+/**
+ * Returns the size of each of a device's ring areas, in bytes.
+ *
+ * @param info The information structure for the relevant device.
+ */
+static inline size_t __ring_area_size(struct openxt_kbd_info *info)
+{
+    return info->shared_rings ? OXT_KBD_SHARED_AREA_SIZE : OXT_KBD_RING_AREA_SIZE(info->ring_order);
+}
+
+
+/**
+ * Frees a ring's area, if it has one.
+ *
+ * @param info The information structure for the relevant device.
+ * @param ring The ring whose area is to be freed.
+ */
+static void __free_ring_area(struct openxt_kbd_info *info, struct oxtkbd_ring *ring)
+{
+    if (!ring->page)
+        return;
+
+    if (info->shared_rings)
+        __put_shared_area(ring->page);
+    else
+        free_pages((unsigned long)ring->page, info->ring_order);
+
+    ring->page = NULL;
+}
+
+
+/**
+ * Discards any events left on each ring, by resetting its indices, and
+ * releases anything they left held down.
+ *
+ * @param info The information structure for the relevant device.
+ */
+static void __reset_rings(struct openxt_kbd_info *info)
+{
+    int i;
+
+    for (i = 0; i < info->ring_count; i++) {
+        struct oxtkbd_ring *ring = &info->rings[i];
+
+        ring->page->in_cons = ring->page->in_prod = 0;
+        ring->page->out_cons = ring->page->out_prod = 0;
+        ring->page->in_cons_event = 0;
+        ring->page->in_prod_event = info->event_index ? 1 : 0;
+        ring->incomplete = false;
+
+        //Our clock estimate is relative to the backend's clock, which may not
+        //have survived S3.
+        ring->have_event_time = false;
+
+        __release_all_inputs(ring);
+    }
+}
+
+
+/**
+ * Resumes use of the input device after sleep/S3.
+ *
+ * @param dev The device to be resumed.
+ */
+static int oxtkbd_resume(struct xenbus_device *dev)
+{
+    int i;
+
+    //Get a reference to the connection's information structure.
+    struct openxt_kbd_info *info = dev_get_drvdata(&dev->dev);
+
+    //Upon resume, we'll want to tear down our existing connection
+    //and reconnect.
+    oxtkbd_disconnect_backend(info);
+
+    //If we're allowed to, reuse everything we set up before S3; there's no
+    //need to renegotiate, or to clear the whole ring area just to discard
+    //the events left on it.
+    if (fast_resume && info->ring_count) {
+        __reset_rings(info);
+        return oxtkbd_establish_connection(dev, info);
+    }
+
+    //Ensure that no events survive past S3.
+    for (i = 0; i < info->ring_count; i++)
+        memset(info->rings[i].page, 0, __ring_area_size(info));
+
+    //The backend may have changed across S3, so find out what it supports
+    //now. If we can't, we'll assume it's unchanged.
+    if (__read_backend_features(dev, info))
+        dev_warn(&dev->dev, "could not re-read backend features\n");
+
+    return oxtkbd_connect_backend(dev, info);
+}
+
+
+/**
+ * Removes the provided OpenXT input connection from the system.
+ *
+ * @param dev There device to be removed.
+ */
+static int oxtkbd_remove(struct xenbus_device *dev)
+{
+    int i;
+
+    //Get a reference to the connection's information structure.
+    struct openxt_kbd_info *info = dev_get_drvdata(&dev->dev);
+
+    //Stop following the backend's geometry...
+    if (info->geometry_watch.node) {
+        unregister_xenbus_watch(&info->geometry_watch);
+        kfree(info->geometry_watch.node);
+    }
+
+    //...disconnect ourself from the backend...
+    device_remove_file(&dev->dev, &dev_attr_irq_cpu);
+    oxtkbd_disconnect_backend(info);
+
+    //...tear down each of our actual input devices, once we're sure we're
+    //not still registering them...
+    __wait_for_registration(info);
+    __destroy_mirror(info);
+    __release_device(info, info->keyboard, OXT_KBD_REG_KEYBOARD);
+    __release_device(info, info->relative_pointer, OXT_KBD_REG_RELATIVE);
+    if (info->absolute_pointer) {
+        input_mt_destroy_slots(info->absolute_pointer);
+        __release_device(info, info->absolute_pointer, OXT_KBD_REG_ABSOLUTE);
+    }
+
+    //... make sure no output queued as they went away is still pending...
+    cancel_delayed_work_sync(&info->output_work);
+
+    //... free our shared rings and statistics...
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++)
+        __free_ring_area(info, &info->rings[i]);
+    debugfs_remove_recursive(info->debugfs);
+    free_percpu(info->stats);
+    kfree(info->touch_slots);
+    kfree(info->contact_map);
+
+    //... finally free our information structure.
+    kmem_cache_free(oxtkbd_info_cache, info);
+    return 0;
+}
+
+
+/**
+ * Ensures we have a zeroed ring area of the given order for each of the
+ * rings we'll share with the backend, replacing any existing rings of a
+ * different size, and freeing any we no longer need.
+ *
+ * @param info The information structure for the relevant device.
+ * @param count The number of rings we'll share.
+ * @param order The size of each ring area, as a power-of-two number of pages.
+ * @param shared True iff each ring area should instead be part of a page
+ *      shared with other devices.
+ *
+ * @return int Zero on success, or an error code on failure.
+ */
+static int __allocate_rings(struct openxt_kbd_info *info, unsigned int count,
+        unsigned int order, bool shared)
+{
+    int i;
+
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++) {
+        struct oxtkbd_ring *ring = &info->rings[i];
+
+        //If we already have a ring of the right size, we'll keep it.
+        if (ring->page && i < count && info->ring_order == order &&
+                info->shared_rings == shared)
+            continue;
+
+        __free_ring_area(info, ring);
+    }
+
+    info->ring_order   = order;
+    info->shared_rings = shared;
+    info->ring_count   = 0;
+
+    for (i = 0; i < count; i++) {
+        struct oxtkbd_ring *ring = &info->rings[i];
+
+        if (ring->page)
+            continue;
+
+        if (shared)
+            ring->page = __get_shared_area(info->xbdev->otherend_id);
+        else
+            ring->page = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, order);
+        if (!ring->page)
+            return -ENOMEM;
+    }
+
+    info->ring_count = count;
+    return 0;
+}
+
+
+/**
+ * Determines how many rings we'll share with the backend, and which events
+ * each will carry.
+ *
+ * @param info The information structure for the device being connected.
+ *
+ * @return The number of rings.
+ */
+static unsigned int __negotiate_ring_count(struct openxt_kbd_info *info)
+{
+    int i, count;
+
+    count = min(info->features.max_rings, max_rings);
+    count = clamp(count, 1, OXT_KBD_MAX_RINGS);
+
+    //With a single ring, everything arrives on it. Otherwise, keyboard keys
+    //get a ring of their own.
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++) {
+        info->rings[i].keyboard_events = (count == 1) || (i == OXT_KBD_KEY_RING);
+        info->rings[i].pointer_events  = (count == 1) || (i == OXT_KBD_POINTER_RING);
+    }
+
+    return count;
+}
+
+
+/**
+ * Determines the size of ring we'll share with the backend: the largest
+ * ring both we and the backend support.
+ *
+ * @param info The information structure for the device being connected.
+ *
+ * @return The ring size, as a power-of-two number of pages.
+ */
+static unsigned int __negotiate_ring_order(struct openxt_kbd_info *info)
+{
+    int backend_order = info->features.max_ring_page_order;
+
+    //Backends that don't advertise multi-page support get a single page.
+    if (backend_order < 0)
+        return 0;
+
+    return min3((unsigned int)backend_order, (unsigned int)max(max_ring_page_order, 0),
+            (unsigned int)OXT_KBD_MAX_RING_PAGE_ORDER);
+}
+
+
+/**
+ * Determines whether our ring areas will be part of pages shared with other
+ * devices, which is only possible for single-page ring areas.
+ *
+ * @param info The information structure for the device being connected.
+ * @param order The size of each ring area, as a power-of-two number of pages.
+ */
+static bool __negotiate_shared_rings(struct openxt_kbd_info *info, unsigned int order)
+{
+    return share_ring_pages && info->features.ring_offset && !order;
+}
+
+
+/**
+ * Determines the format of the in ring we'll share with the backend,
+ * setting up the ring's slot size, length and layout to match.
+ *
+ * @param info The information structure for the device being connected.
+ */
+static void __negotiate_ring_format(struct openxt_kbd_info *info)
+{
+    //Use the compact format only if both we and the backend want to.
+    bool compact = compact_events && info->features.compact_events;
+
+    info->slot_size = compact ? OXT_KBD_COMPACT_EVENT_SIZE : OXT_KBD_IN_EVENT_SIZE;
+
+    //Shared ring areas have a layout of their own. Every ring length but
+    //the legacy layout's is a power of two; see openxt_kbdif.h.
+    if (info->shared_rings) {
+        info->in_ring_offs  = OXT_KBD_SHARED_IN_RING_OFFS;
+        info->out_ring_offs = OXT_KBD_SHARED_AREA_SIZE - OXT_KBD_SHARED_OUT_RING_SIZE;
+        info->out_ring_len  = OXT_KBD_SHARED_OUT_RING_LEN;
+        info->ring_len      = compact ? OXT_KBD_SHARED_COMPACT_IN_RING_LEN :
+                OXT_KBD_SHARED_IN_RING_LEN;
+    }
+    else {
+        info->in_ring_offs  = OXT_KBD_IN_RING_OFFS;
+        info->out_ring_offs = OXT_KBD_OUT_RING_OFFS_ORDER(info->ring_order);
+        info->out_ring_len  = OXT_KBD_OUT_RING_LEN;
+        info->ring_len      = compact ? OXT_KBD_COMPACT_IN_RING_LEN_ORDER(info->ring_order) :
+                OXT_KBD_IN_RING_LEN_ORDER(info->ring_order);
+    }
+}
+
+
+/**
+ * Determines whether we'll use event indices to suppress notifications,
+ * and if so, asks the backend to notify us of its first event.
+ *
+ * @param info The information structure for the device being connected.
+ */
+static void __negotiate_event_index(struct openxt_kbd_info *info)
+{
+    int i;
+
+    info->event_index = event_index && info->features.event_index;
+
+    for (i = 0; info->event_index && i < info->ring_count; i++)
+        info->rings[i].page->in_prod_event = info->rings[i].page->in_cons + 1;
+}
+
+
+/**
+ * Determines whether we'll ask the backend to timestamp its events.
+ *
+ * @param info The information structure for the device being connected.
+ */
+static void __negotiate_timestamps(struct openxt_kbd_info *info)
+{
+    int i;
+
+    info->timestamps = timestamps && info->features.timestamps;
+
+    //Any clock estimate we have belongs to the previous connection.
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++)
+        info->rings[i].have_event_time = false;
+}
+
+
+/**
+ * Determines whether we'll ask the backend for touch batches. There's no
+ * sense in asking unless we can deliver multi-touch events.
+ *
+ * @param info The information structure for the device being connected.
+ */
+static void __negotiate_touch_batches(struct openxt_kbd_info *info)
+{
+    info->touch_batches = touch_batches && info->features.touch_batches &&
+        info->absolute_pointer && info->absolute_pointer->mt;
+
+    //Any contacts we knew of belong to the previous connection.
+    info->batch_contacts = 0;
+}
+
+
+/**
+ * Determines whether we'll send output to the backend. There's no sense in
+ * asking unless one of our devices accepts output.
+ *
+ * @param info The information structure for the device being connected.
+ */
+static void __negotiate_output_events(struct openxt_kbd_info *info)
+{
+    info->output_events = __wants_output_events(info) && __output_kinds(info);
+}
+
+
+/**
+ * Grants the backend access to each page of a ring area, and binds the
+ * ring's own event channel.
+ *
+ * @param dev The device to be connected.
+ * @param ring The ring to be shared.
+ * @param evtchn Receives the ring's event channel.
+ *
+ * @return int Zero on success, or an error code on failure.
+ */
+static int __share_ring(struct xenbus_device *dev, struct oxtkbd_ring *ring,
+        int *evtchn)
+{
+    int i, ret;
+
+    //A shared ring area lives part-way into its page; we grant the whole
+    //page, which only ever holds areas for the same backend.
+    char *base = (char *)((unsigned long)ring->page & PAGE_MASK);
+
+    for (i = 0; i < (1 << ring->info->ring_order); i++) {
+        void *page = base + i * PAGE_SIZE;
+
+        ret = gnttab_grant_foreign_access(dev->otherend_id, virt_to_mfn(page), 0);
+        if (ret < 0)
+            return ret;
+
+        ring->gref[i] = ret;
+    }
+
+    //Next, we'll need to create an event channel we can use to signal that data
+    //has changed in our shared page.
+    ret = xenbus_alloc_evtchn(dev, evtchn);
+    if (ret)
+        return ret;
+
+    //Bind our input handler to our event channel-- ensuring we're recieve any
+    //"new data" notifications.
+    ret = bind_evtchn_to_irqhandler(*evtchn, input_handler, 0, dev->devicetype, ring);
+    if (ret < 0) {
+        xenbus_dev_fatal(dev, ret, "bind_evtchn_to_irqhandler");
+        xenbus_free_evtchn(dev, *evtchn);
+        return ret;
+    }
+
+    //Steering is only an optimization, so failing to steer isn't fatal.
+    mutex_lock(&ring->info->irq_lock);
+    ring->irq = ret;
+    ret = __steer_ring(ring);
+    mutex_unlock(&ring->info->irq_lock);
+    if (ret)
+        dev_warn(&dev->dev, "could not bind ring %u to vCPU %d: %d\n",
+                ring->index, ring->cpu, ret);
+
+    return 0;
+}
+
+
+/**
+ * Revokes the backend's access to each page of a ring area.
+ *
+ * @param ring The ring whose grants should be revoked.
+ */
+static void __end_ring_grants(struct oxtkbd_ring *ring)
+{
+    int i;
+
+    for (i = 0; i < OXT_KBD_MAX_RING_PAGES; i++) {
+        if (ring->gref[i] >= 0)
+            gnttab_end_foreign_access(ring->gref[i], 0, 0UL);
+        ring->gref[i] = -1;
+    }
+}
+
+
+/**
+ * Writes one of a ring's xenstore keys. Ring zero's keys live directly in
+ * our xenstore directory; every other ring's live in a subdirectory.
+ *
+ * @param xbt The transaction in which to write the key.
+ * @param dev The device being connected.
+ * @param ring The ring the key describes.
+ * @param name The key's name.
+ * @param val The key's value.
+ *
+ * @return int Zero on success, or an error code on failure.
+ */
+static int __write_ring_key(struct xenbus_transaction xbt, struct xenbus_device *dev,
+        struct oxtkbd_ring *ring, const char *name, unsigned int val)
+{
+    char key[32];
+
+    if (ring->index)
+        snprintf(key, sizeof(key), "ring%u/%s", ring->index, name);
+    else
+        snprintf(key, sizeof(key), "%s", name);
+
+    return xenbus_printf(xbt, dev->nodename, key, "%u", val);
+}
+
+
+/**
+ * Publishes a ring's grant references and event channel to the XenStore.
+ *
+ * @param xbt The transaction in which to publish the ring.
+ * @param dev The device being connected.
+ * @param ring The ring to be published.
+ * @param evtchn The ring's event channel.
+ *
+ * @return int Zero on success, or an error code on failure.
+ */
+static int __publish_ring(struct xenbus_transaction xbt, struct xenbus_device *dev,
+        struct oxtkbd_ring *ring, int evtchn)
+{
+    int i, ret;
+
+    //Provide our grant reference. This is the preferred way of getting the
+    //shared page.
+    ret = __write_ring_key(xbt, dev, ring, "page-gref", ring->gref[0]);
+    if (ret)
+        return ret;
+
+    //If we've negotiated a multi-page ring, provide a reference to each of
+    //its pages, as well.
+    for (i = 0; ring->info->ring_order && i < (1 << ring->info->ring_order); i++) {
+        char name[sizeof("page-gref") + 4];
+
+        snprintf(name, sizeof(name), "page-gref%u", i);
+        ret = __write_ring_key(xbt, dev, ring, name, ring->gref[i]);
+        if (ret)
+            return ret;
+    }
 
-    //Indicate success.
-    return 0;
+    //If our ring area is shared, say where it is within its page.
+    if (ring->info->shared_rings) {
+        ret = __write_ring_key(xbt, dev, ring, "ring-offset", offset_in_page(ring->page));
+        if (ret)
+            return ret;
+    }
 
- error_nomem:
-    ret = -ENOMEM;
-    xenbus_dev_fatal(dev, ret, "allocating device memory");
- error:
-    oxtkbd_remove(dev);
-    return ret;
+    //Provide the number for our event channel, so the backend can signal
+    //new informatino to us.
+    return __write_ring_key(xbt, dev, ring, "event-channel", evtchn);
 }
 
+
 /**
- * Resumes use of the input device after sleep/S3.
+ * Unbinds each ring's event channel, and revokes the backend's access to
+ * each ring.
  *
- * @param dev The device to be resumed.
+ * @param info The information structure for the relevant device.
  */
-static int oxtkbd_resume(struct xenbus_device *dev)
+static void __unshare_rings(struct openxt_kbd_info *info)
 {
-    //Get a reference to the connection's information structure.
-    struct openxt_kbd_info *info = dev_get_drvdata(&dev->dev);
+    int i;
 
-    //Upon resume, we'll want to tear down our existing connection
-    //and reconnect.
-    oxtkbd_disconnect_backend(info);
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++) {
+        struct oxtkbd_ring *ring = &info->rings[i];
 
-    //Ensure that no events survive past S3.
-    memset(info->page, 0, PAGE_SIZE);
+        mutex_lock(&info->irq_lock);
+        if (ring->irq >= 0) {
+            irq_set_affinity_hint(ring->irq, NULL);
+            unbind_from_irqhandler(ring->irq, ring);
+        }
+        ring->irq = -1;
+        mutex_unlock(&info->irq_lock);
 
-    return oxtkbd_connect_backend(dev, info);
+        __end_ring_grants(ring);
+    }
 }
 
 
 /**
- * Removes the provided OpenXT input connection from the system.
+ * Connect the OpenXT input device to the corresponding backend.
  *
- * @param dev There device to be removed.
+ * @param dev The device to be connected.
+ * @param info The information structure that corresponds to the given device.
+ *
+ * @return int Zero on success, or an error code on failure.
  */
-static int oxtkbd_remove(struct xenbus_device *dev)
+static int oxtkbd_connect_backend(struct xenbus_device *dev,
+                  struct openxt_kbd_info *info)
 {
-    //Get a reference to the connection's information structure.
-    struct openxt_kbd_info *info = dev_get_drvdata(&dev->dev);
-
-    //Disconnect ourself from the backend...
-    oxtkbd_disconnect_backend(info);
-
-    //...tear down each of our actual input devices...
-    if (info->keyboard)
-        input_unregister_device(info->keyboard);
-    if (info->relative_pointer)
-        input_unregister_device(info->relative_pointer);
-    if (info->absolute_pointer) {
-        input_mt_destroy_slots(info->absolute_pointer);
-        input_unregister_device(info->absolute_pointer);
+    int ret;
+    unsigned int order;
+
+    //To communicate with the backend, we'll share a small ring area-- a single
+    //page, or part of one, unless the backend can handle more. Make sure we
+    //have one, and agree with the backend on how we'll use it.
+    order = __negotiate_ring_order(info);
+    ret = __allocate_rings(info, __negotiate_ring_count(info), order,
+            __negotiate_shared_rings(info, order));
+    if (ret) {
+        xenbus_dev_fatal(dev, ret, "allocating shared ring");
+        return ret;
     }
 
-    //... free our shared page...
-    free_page((unsigned long)info->page);
+    __negotiate_ring_format(info);
+    __negotiate_event_index(info);
+    __negotiate_timestamps(info);
+    __negotiate_touch_batches(info);
+    __negotiate_output_events(info);
 
-    //... finally free our information structure.
-    kfree(info);
-    return 0;
+    return oxtkbd_establish_connection(dev, info);
 }
 
 
 /**
- * Connect the OpenXT input device to the corresponding backend.
+ * Shares our rings with the backend, binds an event channel for each, and
+ * publishes them-- along with the parameters we've negotiated-- to the
+ * XenStore.
  *
  * @param dev The device to be connected.
  * @param info The information structure that corresponds to the given device.
  *
  * @return int Zero on success, or an error code on failure.
  */
-static int oxtkbd_connect_backend(struct xenbus_device *dev,
+static int oxtkbd_establish_connection(struct xenbus_device *dev,
                   struct openxt_kbd_info *info)
 {
-    int ret, evtchn;
+    int i, ret, evtchn[OXT_KBD_MAX_RINGS];
+    unsigned int delay_ms = OXT_KBD_MIN_BACKOFF_MS;
     struct xenbus_transaction xbt;
 
-    //To communicate with the backend, we'll share a single page of memory
-    //We'll start this process by granting out our "shared page".
-    ret = gnttab_grant_foreign_access(dev->otherend_id, virt_to_mfn(info->page), 0);
-    if (ret < 0)
-        return ret;
-
-    info->gref = ret;
-
-    //Next, we'll need to create an event channel we can use to signal that data
-    //has changed in our shared page.
-    ret = xenbus_alloc_evtchn(dev, &evtchn);
-    if (ret)
-        goto error_grant;
-
-    //Bind our input handler to our event channel-- ensuring we're recieve any
-    //"new data" notifications.
-    ret = bind_evtchn_to_irqhandler(evtchn, input_handler, 0, dev->devicetype, info);
-    if (ret < 0) {
-        xenbus_dev_fatal(dev, ret, "bind_evtchn_to_irqhandler");
-        goto error_evtchan;
+    //Grant each of our rings out to the backend, each with its own event
+    //channel.
+    for (i = 0; i < info->ring_count; i++) {
+        ret = __share_ring(dev, &info->rings[i], &evtchn[i]);
+        if (ret < 0)
+            goto error_share;
     }
 
-    info->irq = ret;
-
  again:
 
     //Now that we've set up our shared assets, we'll need to communicate them
@@ -581,27 +5118,72 @@ static int oxtkbd_connect_backend(struct xenbus_device *dev,
     ret = xenbus_transaction_start(&xbt);
     if (ret) {
         xenbus_dev_fatal(dev, ret, "starting transaction");
-        goto error_irqh;
+        goto error_share;
     }
 
     //Provide a direct reference to the page. This allows backends that want
     //to use foreign mappings (i.e. legacy backends) to map in the shared page
     //without touching grants.
-    ret = xenbus_printf(xbt, dev->nodename, "page-ref", "%lu", virt_to_mfn(info->page));
+    ret = xenbus_printf(xbt, dev->nodename, "page-ref", "%lu",
+            virt_to_mfn(info->rings[0].page));
     if (ret)
         goto error_xenbus;
 
-    //And provide our grant reference. This is the preferred way of getting the
-    //shared page.
-    ret = xenbus_printf(xbt, dev->nodename, "page-gref", "%u", info->gref);
-    if (ret)
-        goto error_xenbus;
+    //If we've negotiated a multi-page ring, say how large it is.
+    if (info->ring_order) {
+        ret = xenbus_printf(xbt, dev->nodename, "ring-page-order", "%u", info->ring_order);
+        if (ret)
+            goto error_xenbus;
+    }
 
-    //Provide the number for our event channel, so the backend can signal
-    //new informatino to us.
-    ret = xenbus_printf(xbt, dev->nodename, "event-channel", "%u", evtchn);
-    if (ret)
-        goto error_xenbus;
+    //If we've negotiated more than one ring, say how many.
+    if (info->ring_count > 1) {
+        ret = xenbus_printf(xbt, dev->nodename, "rings", "%u", info->ring_count);
+        if (ret)
+            goto error_xenbus;
+    }
+
+    //Provide the grant references and event channel for each ring.
+    for (i = 0; i < info->ring_count; i++) {
+        ret = __publish_ring(xbt, dev, &info->rings[i], evtchn[i]);
+        if (ret)
+            goto error_xenbus;
+    }
+
+    //If we'd like compact events, ask for them.
+    if (info->slot_size == OXT_KBD_COMPACT_EVENT_SIZE) {
+        ret = xenbus_printf(xbt, dev->nodename, "request-compact-events", "%u", 1);
+        if (ret)
+            goto error_xenbus;
+    }
+
+    //If we'd like to use event indices, ask for them.
+    if (info->event_index) {
+        ret = xenbus_printf(xbt, dev->nodename, "request-event-index", "%u", 1);
+        if (ret)
+            goto error_xenbus;
+    }
+
+    //If we'd like timestamps, ask for them.
+    if (info->timestamps) {
+        ret = xenbus_printf(xbt, dev->nodename, "request-timestamps", "%u", 1);
+        if (ret)
+            goto error_xenbus;
+    }
+
+    //If we'd like touch batches, ask for them.
+    if (info->touch_batches) {
+        ret = xenbus_printf(xbt, dev->nodename, "request-touch-batch", "%u", 1);
+        if (ret)
+            goto error_xenbus;
+    }
+
+    //If we'd like to send output, say so.
+    if (info->output_events) {
+        ret = xenbus_printf(xbt, dev->nodename, "request-output-events", "%u", 1);
+        if (ret)
+            goto error_xenbus;
+    }
 
     //Attempt to apply all of our changes at once.
     ret = xenbus_transaction_end(xbt, 0);
@@ -610,13 +5192,17 @@ static int oxtkbd_connect_backend(struct xenbus_device *dev,
     if (ret) {
 
         //... it may have been because the XenStore was busy. If this is the case,
-        //repeat out transaction until we succeed, or hit an error.
-        if (ret == -EAGAIN)
+        //repeat out transaction until we succeed, or hit an error-- backing
+        //off a little more each time, so we don't keep colliding with other
+        //devices that are starting up alongside us.
+        if (ret == -EAGAIN) {
+            __transaction_backoff(&delay_ms);
             goto again;
+        }
 
         //Otherwise, we couldn't connect. Bail out!
         xenbus_dev_fatal(dev, ret, "completing transaction");
-        goto error_irqh;
+        goto error_share;
     }
 
     //Finally, switch our state to "intialized", hopefully cueing the backend
@@ -627,14 +5213,8 @@ static int oxtkbd_connect_backend(struct xenbus_device *dev,
  error_xenbus:
     xenbus_transaction_end(xbt, 1);
     xenbus_dev_fatal(dev, ret, "writing xenstore");
- error_irqh:
-    unbind_from_irqhandler(info->irq, info);
-    info->irq = -1;
- error_evtchan:
-    xenbus_free_evtchn(dev, evtchn);
- error_grant:
-    gnttab_end_foreign_access(info->gref, 0, 0UL);
-    info->gref = -1;
+ error_share:
+    __unshare_rings(info);
     return ret;
 }
 
@@ -646,16 +5226,31 @@ static int oxtkbd_connect_backend(struct xenbus_device *dev,
  */
 static void oxtkbd_disconnect_backend(struct openxt_kbd_info *info)
 {
+    int i;
+
+    //Stop sending output first, as it uses ring zero's event channel.
+    __stop_output(info);
 
-    //If we had an input IRQ registered, tear it down.
-    if (info->irq >= 0)
-        unbind_from_irqhandler(info->irq, info);
-    info->irq = -1;
+    //If we had input IRQs registered, quiesce them. We mask each first,
+    //so no deferred drain can be left behind to unmask it afterwards.
+    for (i = 0; i < OXT_KBD_MAX_RINGS; i++) {
+        struct oxtkbd_ring *ring = &info->rings[i];
+
+        if (ring->irq >= 0) {
+            disable_irq(ring->irq);
+            hrtimer_cancel(&ring->moderation_timer);
+            hrtimer_cancel(&ring->poll_timer);
+            tasklet_kill(&ring->drain_tasklet);
+        }
+        ring->moderating = false;
+        ring->moderation_masked = false;
+        ring->polling = false;
+        ring->poll_masked = false;
+        ring->incomplete = false;
+    }
 
-    //... and if we have a shared page for our ring, tear it down.
-    if (info->gref >= 0)
-        gnttab_end_foreign_access(info->gref, 0, 0UL);
-    info->gref = -1;
+    //... then tear them down, and revoke the backend's access to our rings.
+    __unshare_rings(info);
 }
 
 
@@ -666,7 +5261,6 @@ static void oxtkbd_disconnect_backend(struct openxt_kbd_info *info)
 static void oxtkbd_backend_changed(struct xenbus_device *dev,
                    enum xenbus_state backend_state)
 {
-    int val;
     struct openxt_kbd_info *info = dev_get_drvdata(&dev->dev);
 
     switch (backend_state) {
@@ -679,6 +5273,9 @@ static void oxtkbd_backend_changed(struct xenbus_device *dev,
 
     case XenbusStateInitWait:
 InitWait:
+        //Make sure our devices exist before the backend can start sending
+        //us events for them.
+        __wait_for_registration(info);
         xenbus_switch_state(dev, XenbusStateConnected);
         break;
 
@@ -691,20 +5288,13 @@ InitWait:
         if (dev->state != XenbusStateConnected)
             goto InitWait; /* no InitWait seen yet, fudge it */
 
-        //Once we connect, try to adjust the screen width and height
-        //to match the width and height stored in the XenStore.
-        if (xenbus_scanf(XBT_NIL, info->xbdev->otherend,
-                 "width", "%d", &val) > 0) {
-            input_set_abs_params(info->absolute_pointer, ABS_X, 0, val, 0, 0);
-            input_set_abs_params(info->absolute_pointer, ABS_MT_POSITION_X, 0, val, 0, 0);
-        }
-
-        if (xenbus_scanf(XBT_NIL, info->xbdev->otherend,
-                 "height", "%d", &val) > 0) {
-            input_set_abs_params(info->absolute_pointer, ABS_Y, 0, val, 0, 0);
-            input_set_abs_params(info->absolute_pointer, ABS_MT_POSITION_Y, 0, val, 0, 0);
-        }
+        //Once we connect, make sure our absolute axes match the width and
+        //height stored in the XenStore. Our geometry watch keeps them up to
+        //date from here on.
+        __refresh_geometry(info);
 
+        //And tell the backend what our output state is.
+        __start_output(info);
         break;
 
     case XenbusStateClosed:
@@ -738,6 +5328,464 @@ static struct xenbus_driver oxtkbd_driver = {
     .remove           = oxtkbd_remove,
     .resume           = oxtkbd_resume,
     .otherend_changed = oxtkbd_backend_changed,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+    //Each device's probe mostly waits on the XenStore, so when a guest has
+    //many of them, probe them in parallel.
+    .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
+};
+
+
+/*
+ * Ring replay benchmark.
+ *
+ * Writing "<scenario> [events [batch]]" to <debugfs>/openxt-kbdfront/bench
+ * replays a synthetic event stream through our decode path, batch events
+ * at a time, as though the backend had produced them; reading it back
+ * reports how quickly they were handled. The "replay" scenario replays the
+ * raw events last written to <debugfs>/openxt-kbdfront/replay, as captured
+ * by the oxtkbd_ring_event tracepoint, so field traces can be reproduced.
+ * The stream is decoded using the same module parameters as a real device,
+ * so the effect of coalescing, deduplication and the compact format can be
+ * compared directly.
+ *
+ * Replay uses a private ring, so no real backend is needed. Its input
+ * devices are allocated, so that events are routed and checked just as
+ * they would be, but are never registered: nothing appears to userspace,
+ * and the decoded events are dropped instead of being passed to the input
+ * core. As the input core never sees them, replayed contacts are always
+ * mapped using our own contact map, even with mt_kernel_tracking set.
+ */
+
+//The most events a single benchmark run may replay.
+#define OXT_KBD_BENCH_MAX_EVENTS  (16 * 1024 * 1024)
+
+//The number of contacts in the touch scenario, and the number of frames
+//in each cycle of touching down, moving and lifting off: one second's
+//worth, at 240Hz.
+#define OXT_KBD_BENCH_CONTACTS    10
+#define OXT_KBD_BENCH_TOUCH_CYCLE 240
+
+/**
+ * A synthetic event stream.
+ */
+struct oxtkbd_bench_scenario {
+    const char *name;
+
+    //The number of events handed to us per interrupt, by default.
+    unsigned int batch;
+
+    //Fills in the n-th event of the stream.
+    void (*generate)(union oxtkbd_in_event *event, unsigned int n);
+};
+
+
+/**
+ * Generates a 1kHz mouse: a stream of motion, with a click every quarter
+ * of a second.
+ */
+static void __bench_mouse(union oxtkbd_in_event *event, unsigned int n)
+{
+    if (n % 250 == 0) {
+        event->key.type    = OXT_KBD_TYPE_KEY;
+        event->key.pressed = (n / 250) & 1 ? 0 : 1;
+        event->key.keycode = BTN_LEFT;
+        return;
+    }
+
+    event->motion.type  = OXT_KBD_TYPE_MOTION;
+    event->motion.rel_x = 1 + n % 3;
+    event->motion.rel_y = -(int)(n % 2);
+    event->motion.rel_z = 0;
+}
+
+
+/**
+ * Generates a ten-finger touch at 240Hz: each frame carries an event for
+ * every contact, followed by a frame marker.
+ */
+static void __bench_touch(union oxtkbd_in_event *event, unsigned int n)
+{
+    unsigned int frame   = (n / (OXT_KBD_BENCH_CONTACTS + 1)) % OXT_KBD_BENCH_TOUCH_CYCLE;
+    unsigned int contact = n % (OXT_KBD_BENCH_CONTACTS + 1);
+    int32_t x = 1000 + contact * 2000 + frame * 8;
+    int32_t y = 1000 + contact * 1000 + frame * 4;
+
+    if (contact == OXT_KBD_BENCH_CONTACTS) {
+        event->touch_frame.type = OXT_KBD_TYPE_TOUCH_FRAME;
+        return;
+    }
+
+    if (frame == 0) {
+        event->touch_down.type  = OXT_KBD_TYPE_TOUCH_DOWN;
+        event->touch_down.id    = contact;
+        event->touch_down.abs_x = x;
+        event->touch_down.abs_y = y;
+    } else if (frame == OXT_KBD_BENCH_TOUCH_CYCLE - 1) {
+        event->touch_up.type = OXT_KBD_TYPE_TOUCH_UP;
+        event->touch_up.id   = contact;
+    } else {
+        event->touch_move.type  = OXT_KBD_TYPE_TOUCH_MOVE;
+        event->touch_move.id    = contact;
+        event->touch_move.abs_x = x;
+        event->touch_move.abs_y = y;
+    }
+}
+
+
+/**
+ * The raw events to be replayed by the "replay" scenario, each
+ * OXT_KBD_TRACE_RECORD_SIZE bytes long. Protected by oxtkbd_bench_lock.
+ */
+static u8 *oxtkbd_replay_records;
+static size_t oxtkbd_replay_bytes;
+
+//The most raw events we'll hold for replay.
+#define OXT_KBD_REPLAY_MAX_RECORDS  (1024 * 1024)
+
+
+/**
+ * Generates the captured events, in order, repeating them as necessary.
+ */
+static void __bench_replay(union oxtkbd_in_event *event, unsigned int n)
+{
+    size_t count = oxtkbd_replay_bytes / OXT_KBD_TRACE_RECORD_SIZE;
+
+    memcpy(event, oxtkbd_replay_records + (n % count) * OXT_KBD_TRACE_RECORD_SIZE,
+            OXT_KBD_TRACE_RECORD_SIZE);
+}
+
+
+/**
+ * Generates bursts of typing: presses and releases of a row of letters.
+ */
+static void __bench_typing(union oxtkbd_in_event *event, unsigned int n)
+{
+    event->key.type    = OXT_KBD_TYPE_KEY;
+    event->key.pressed = !(n & 1);
+    event->key.keycode = KEY_Q + (n / 2) % 10;
+}
+
+
+static const struct oxtkbd_bench_scenario oxtkbd_bench_scenarios[] = {
+    { "mouse",  1,                          __bench_mouse  },
+    { "touch",  OXT_KBD_BENCH_CONTACTS + 1, __bench_touch  },
+    { "typing", 16,                         __bench_typing },
+    { "replay", 1,                          __bench_replay },
+};
+
+
+/**
+ * The results of the most recent benchmark run.
+ */
+struct oxtkbd_bench_result {
+    const char *scenario;
+    unsigned int events;
+    unsigned int batch;
+    unsigned int slot_size;
+    u64 passes;
+    u64 syncs;
+    u64 elapsed_ns;
+};
+
+//Serializes benchmark runs, and protects the last run's results.
+static DEFINE_MUTEX(oxtkbd_bench_lock);
+static struct oxtkbd_bench_result oxtkbd_bench_last;
+
+
+/**
+ * Frees a benchmark device, and everything it owns.
+ *
+ * @param info The benchmark device to be freed.
+ */
+static void __bench_free(struct openxt_kbd_info *info)
+{
+    __release_device(info, info->keyboard, OXT_KBD_REG_KEYBOARD);
+    __release_device(info, info->relative_pointer, OXT_KBD_REG_RELATIVE);
+    if (info->absolute_pointer) {
+        input_mt_destroy_slots(info->absolute_pointer);
+        __release_device(info, info->absolute_pointer, OXT_KBD_REG_ABSOLUTE);
+    }
+
+    //Output is never sent, as we've no backend, but may have been queued.
+    cancel_delayed_work_sync(&info->output_work);
+
+    __free_ring_area(info, &info->rings[0]);
+    free_percpu(info->stats);
+    kfree(info->touch_slots);
+    kfree(info->contact_map);
+    kmem_cache_free(oxtkbd_info_cache, info);
+}
+
+
+/**
+ * Creates a benchmark device: one that looks like a device connected to a
+ * backend supporting every event we handle, over a single ring.
+ *
+ * @return The new device, or NULL if it couldn't be allocated.
+ */
+static struct openxt_kbd_info *__bench_allocate(void)
+{
+    struct openxt_kbd_info *info = kmem_cache_zalloc(oxtkbd_info_cache, GFP_KERNEL);
+    struct oxtkbd_ring *ring;
+
+    if (!info)
+        return NULL;
+
+    spin_lock_init(&info->output_lock);
+    INIT_DELAYED_WORK(&info->output_work, oxtkbd_output_work);
+    snprintf(info->phys, sizeof(info->phys), "openxt-kbdfront/bench");
+    info->features.max_ring_page_order = -1;
+    info->features.compact_events = true;
+
+    info->stats = alloc_percpu(struct oxtkbd_stats);
+    if (!info->stats || __allocate_touch_state(NULL, info))
+        goto error;
+
+    info->keyboard         = __allocate_keyboard_device(info, "Xen Virtual Keyboard (bench)");
+    info->relative_pointer = __allocate_pointer_device(info, "Xen Relative Pointer (bench)", false, false);
+    info->absolute_pointer = __allocate_pointer_device(info, "Xen Absolute Pointer (bench)", true, true);
+    if (!info->keyboard || !info->relative_pointer || !info->absolute_pointer)
+        goto error;
+
+    info->last_pointer = info->relative_pointer;
+    __build_key_routes(info);
+    __update_abs_scale(info);
+    info->deduplicating_touches = __wants_touch_dedupe();
+
+    //Use the ring format we'd negotiate with a real backend. We use event
+    //indices only so that we're never asked to notify a backend we don't
+    //have.
+    if (__allocate_rings(info, 1, 0, false))
+        goto error;
+    __negotiate_ring_format(info);
+    info->event_index = true;
+
+    ring = &info->rings[0];
+    ring->info = info;
+    ring->irq  = -1;
+    spin_lock_init(&ring->lock);
+    ring->keyboard_events = true;
+    ring->pointer_events  = true;
+
+    //Our input devices are never registered, and only describe what each
+    //device can deliver; the ring delivers everything we decode nowhere.
+    ring->bench = true;
+
+    return info;
+
+ error:
+    __bench_free(info);
+    return NULL;
+}
+
+
+/**
+ * Replays a synthetic event stream through our decode path.
+ *
+ * @param scenario The stream to replay.
+ * @param events The number of events to replay.
+ * @param batch The number of events to produce before each pass over the
+ *      ring, or zero to use the scenario's default.
+ * @param result Filled in with the results of the run.
+ *
+ * @return Zero on success, or an error code on failure.
+ */
+static int __bench_run(const struct oxtkbd_bench_scenario *scenario,
+        unsigned int events, unsigned int batch, struct oxtkbd_bench_result *result)
+{
+    struct openxt_kbd_info *info = __bench_allocate();
+    struct oxtkbd_ring *ring;
+    unsigned int done = 0;
+
+    if (!info)
+        return -ENOMEM;
+
+    ring  = &info->rings[0];
+    batch = clamp(batch ? batch : scenario->batch, 1U, info->ring_len);
+
+    memset(result, 0, sizeof(*result));
+    result->scenario  = scenario->name;
+    result->events    = events;
+    result->batch     = batch;
+    result->slot_size = info->slot_size;
+
+    while (done < events) {
+        unsigned int count = min(batch, events - done);
+        __u32 prod = ring->page->in_prod;
+        ktime_t started;
+        unsigned int i;
+
+        //Produce a batch of events, as the backend would...
+        for (i = 0; i < count; i++) {
+            union oxtkbd_in_event *event = __ring_event(ring, prod + i);
+
+            memset(event, 0, info->slot_size);
+            scenario->generate(event, done + i);
+        }
+        wmb();
+        ring->page->in_prod = prod + count;
+        ring->page->in_cons_event = ring->page->in_cons;
+
+        //... and time only our handling of them, under the same lock as
+        //our IRQ handler would hold.
+        spin_lock_irq(&ring->lock);
+        started = ktime_get();
+        __drain_ring(ring, UINT_MAX);
+        result->elapsed_ns += ktime_to_ns(ktime_sub(ktime_get(), started));
+        spin_unlock_irq(&ring->lock);
+        result->passes++;
+
+        done += count;
+        cond_resched();
+    }
+
+    result->syncs = ring->syncs;
+
+    __bench_free(info);
+    return 0;
+}
+
+
+static int oxtkbd_bench_show(struct seq_file *m, void *unused)
+{
+    struct oxtkbd_bench_result *result = &oxtkbd_bench_last;
+    u64 ns;
+
+    mutex_lock(&oxtkbd_bench_lock);
+
+    if (!result->scenario) {
+        seq_puts(m, "scenarios: mouse touch typing replay\n");
+        seq_puts(m, "usage: echo '<scenario> [events [batch]]' > bench\n");
+        goto out;
+    }
+
+    ns = max_t(u64, result->elapsed_ns, 1);
+
+    seq_printf(m, "scenario: %s\n", result->scenario);
+    seq_printf(m, "events: %u\n", result->events);
+    seq_printf(m, "batch: %u\n", result->batch);
+    seq_printf(m, "slot_size: %u\n", result->slot_size);
+    seq_printf(m, "passes: %llu\n", result->passes);
+    seq_printf(m, "input_syncs: %llu\n", result->syncs);
+    seq_printf(m, "elapsed_ns: %llu\n", result->elapsed_ns);
+    seq_printf(m, "events_per_sec: %llu\n", div64_u64((u64)result->events * NSEC_PER_SEC, ns));
+    seq_printf(m, "ns_per_event: %llu\n", div64_u64(ns, max(result->events, 1U)));
+
+ out:
+    mutex_unlock(&oxtkbd_bench_lock);
+    return 0;
+}
+
+
+static int oxtkbd_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, oxtkbd_bench_show, inode->i_private);
+}
+
+
+static ssize_t oxtkbd_bench_write(struct file *file, const char __user *ubuf,
+        size_t len, loff_t *ppos)
+{
+    const struct oxtkbd_bench_scenario *scenario = NULL;
+    unsigned int events = 0, batch = 0;
+    size_t captured;
+    char buf[64], name[16];
+    int i, args, ret;
+
+    if (len >= sizeof(buf))
+        return -EINVAL;
+    if (copy_from_user(buf, ubuf, len))
+        return -EFAULT;
+    buf[len] = '\0';
+
+    args = sscanf(buf, "%15s %u %u", name, &events, &batch);
+    if (args < 1)
+        return -EINVAL;
+
+    for (i = 0; i < ARRAY_SIZE(oxtkbd_bench_scenarios); i++)
+        if (!strcmp(name, oxtkbd_bench_scenarios[i].name))
+            scenario = &oxtkbd_bench_scenarios[i];
+    if (!scenario)
+        return -EINVAL;
+
+    mutex_lock(&oxtkbd_bench_lock);
+
+    //Replays default to a single pass over the capture.
+    captured = oxtkbd_replay_bytes / OXT_KBD_TRACE_RECORD_SIZE;
+    if (args < 2)
+        events = (scenario->generate == __bench_replay) ? captured : 100000;
+
+    if (scenario->generate == __bench_replay && !captured)
+        ret = -ENODATA;
+    else if (!events || events > OXT_KBD_BENCH_MAX_EVENTS)
+        ret = -EINVAL;
+    else
+        ret = __bench_run(scenario, events, batch, &oxtkbd_bench_last);
+
+    mutex_unlock(&oxtkbd_bench_lock);
+
+    return ret ? ret : len;
+}
+
+
+static const struct file_operations oxtkbd_bench_fops = {
+    .owner   = THIS_MODULE,
+    .open    = oxtkbd_bench_open,
+    .read    = seq_read,
+    .write   = oxtkbd_bench_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+
+static int oxtkbd_replay_open(struct inode *inode, struct file *file)
+{
+    //Opening the capture for writing with O_TRUNC starts a new capture.
+    if (file->f_flags & O_TRUNC) {
+        mutex_lock(&oxtkbd_bench_lock);
+        oxtkbd_replay_bytes = 0;
+        mutex_unlock(&oxtkbd_bench_lock);
+    }
+
+    return nonseekable_open(inode, file);
+}
+
+
+/**
+ * Appends raw events to the capture to be replayed. Records may be split
+ * across writes.
+ */
+static ssize_t oxtkbd_replay_write(struct file *file, const char __user *ubuf,
+        size_t len, loff_t *ppos)
+{
+    const size_t capacity = OXT_KBD_REPLAY_MAX_RECORDS * OXT_KBD_TRACE_RECORD_SIZE;
+    ssize_t ret = len;
+
+    mutex_lock(&oxtkbd_bench_lock);
+
+    if (!oxtkbd_replay_records)
+        oxtkbd_replay_records = vmalloc(capacity);
+
+    if (!oxtkbd_replay_records)
+        ret = -ENOMEM;
+    else if (len > capacity - oxtkbd_replay_bytes)
+        ret = -ENOSPC;
+    else if (copy_from_user(oxtkbd_replay_records + oxtkbd_replay_bytes, ubuf, len))
+        ret = -EFAULT;
+    else
+        oxtkbd_replay_bytes += len;
+
+    mutex_unlock(&oxtkbd_bench_lock);
+    return ret;
+}
+
+
+static const struct file_operations oxtkbd_replay_fops = {
+    .owner   = THIS_MODULE,
+    .open    = oxtkbd_replay_open,
+    .write   = oxtkbd_replay_write,
+    .llseek  = no_llseek,
 };
 
 
@@ -746,6 +5794,43 @@ static struct xenbus_driver oxtkbd_driver = {
  */
 static int __init oxtkbd_init(void)
 {
+    int ret;
+
+    //Every event we handle has to fit into a compact ring slot.
+    BUILD_BUG_ON(sizeof(struct xenkbd_motion) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct xenkbd_key) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct xenkbd_position) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct oxtkbd_touch_down) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct oxtkbd_touch_move) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct oxtkbd_touch_move_packed) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct oxtkbd_timestamp) > OXT_KBD_COMPACT_EVENT_SIZE);
+    BUILD_BUG_ON(sizeof(struct oxtkbd_touch_batch) != OXT_KBD_TOUCH_BATCH_HEADER_SIZE);
+    BUILD_BUG_ON(OXT_KBD_COMPACT_EVENT_SIZE % sizeof(struct oxtkbd_batch_position));
+    BUILD_BUG_ON(OXT_KBD_IN_EVENT_SIZE % sizeof(struct oxtkbd_batch_position));
+
+    //Each in ring has to fit ahead of its out ring, at every order.
+    BUILD_BUG_ON(OXT_KBD_IN_RING_LEN_ORDER(1) * OXT_KBD_IN_EVENT_SIZE >
+            OXT_KBD_IN_RING_SIZE_ORDER(1));
+    BUILD_BUG_ON(OXT_KBD_COMPACT_IN_RING_LEN_ORDER(0) * OXT_KBD_COMPACT_EVENT_SIZE >
+            OXT_KBD_IN_RING_SIZE_ORDER(0));
+    BUILD_BUG_ON(OXT_KBD_SHARED_IN_RING_LEN * OXT_KBD_IN_EVENT_SIZE >
+            OXT_KBD_SHARED_IN_RING_SIZE);
+    BUILD_BUG_ON(OXT_KBD_SHARED_COMPACT_IN_RING_LEN * OXT_KBD_COMPACT_EVENT_SIZE >
+            OXT_KBD_SHARED_IN_RING_SIZE);
+
+    //The mirror's header has to fit before its records.
+    BUILD_BUG_ON(sizeof(struct oxtkbd_mirror_header) > OXT_KBD_MIRROR_EVENTS_OFFSET);
+
+    //Output events have to fit in an out ring slot, and LED state in a
+    //single output event.
+    BUILD_BUG_ON(sizeof(union oxtkbd_out_event) != OXT_KBD_OUT_EVENT_SIZE);
+    BUILD_BUG_ON(LED_CNT > 32);
+
+    //The state we use on every event should share a single cache line, and
+    //each page should hold no more shared ring areas than we can track.
+    BUILD_BUG_ON(offsetof(struct openxt_kbd_info, rings) > L1_CACHE_BYTES);
+    BUILD_BUG_ON(OXT_KBD_SHARED_AREAS_PER_PAGE > BITS_PER_LONG);
+
     //If we're not on Xen, we definitely don't apply.
     if (!xen_domain())
         return -ENODEV;
@@ -760,8 +5845,23 @@ static int __init oxtkbd_init(void)
     if (!xen_has_pv_devices())
         return -ENODEV;
 
+    //Our information structures are large, and we may have many; so keep
+    //them in a cache of their own, aligned as they ask.
+    oxtkbd_info_cache = KMEM_CACHE(openxt_kbd_info, SLAB_HWCACHE_ALIGN);
+    if (!oxtkbd_info_cache)
+        return -ENOMEM;
+
     //Otheriwse, register our driver!
-    return xenbus_register_frontend(&oxtkbd_driver);
+    oxtkbd_debugfs_root = debugfs_create_dir("openxt-kbdfront", NULL);
+    debugfs_create_file("bench", S_IRUSR | S_IWUSR, oxtkbd_debugfs_root, NULL, &oxtkbd_bench_fops);
+    debugfs_create_file("replay", S_IWUSR, oxtkbd_debugfs_root, NULL, &oxtkbd_replay_fops);
+    ret = xenbus_register_frontend(&oxtkbd_driver);
+    if (ret) {
+        debugfs_remove_recursive(oxtkbd_debugfs_root);
+        kmem_cache_destroy(oxtkbd_info_cache);
+    }
+
+    return ret;
 }
 
 
@@ -771,6 +5871,9 @@ static int __init oxtkbd_init(void)
 static void __exit oxtkbd_cleanup(void)
 {
     xenbus_unregister_driver(&oxtkbd_driver);
+    debugfs_remove_recursive(oxtkbd_debugfs_root);
+    vfree(oxtkbd_replay_records);
+    kmem_cache_destroy(oxtkbd_info_cache);
 }
 
 module_init(oxtkbd_init);
@@ -0,0 +1,79 @@
+/*
+ * OpenXT para-virtual input device: input mirror
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __OPENXT_KBD_MIRROR_H__
+#define __OPENXT_KBD_MIRROR_H__
+
+/*
+ * Input mirror.
+ *
+ * When the driver is loaded with input_mirror set, each device also
+ * provides a character device, /dev/oxtkbd-<device>, through which a trusted
+ * consumer-- such as a compositor-- can read the device's decoded input
+ * without going through evdev. Evdev continues to receive every event.
+ *
+ * Mapping the character device (read-only) maps a shared area consisting of
+ * an oxtkbd_mirror_header, followed at OXT_KBD_MIRROR_EVENTS_OFFSET by a
+ * ring of header->size oxtkbd_mirror_event records. Each record is the
+ * input_event an evdev reader would have seen, tagged with the device that
+ * produced it; every packet ends with an EV_SYN/SYN_REPORT record, exactly
+ * as with evdev.
+ *
+ * The kernel writes each record into slot (index % size), and then advances
+ * header->prod, a free-running count of the records written. Readers keep
+ * their own consumer index; a reader that falls more than size records
+ * behind has lost the records in between, and should resynchronize from
+ * the next SYN_REPORT. Readers should read prod before the records it
+ * covers, and re-check it afterwards, to detect records being overwritten
+ * while they're read.
+ *
+ * Reading four bytes from the character device blocks until records beyond
+ * those the caller last saw are available, and then returns the current
+ * value of prod; poll() reports the device readable under the same
+ * condition.
+ */
+#define OXT_KBD_MIRROR_VERSION        1
+#define OXT_KBD_MIRROR_EVENTS_OFFSET  64
+
+/* The devices whose records appear in the mirror. */
+#define OXT_KBD_MIRROR_KEYBOARD   0
+#define OXT_KBD_MIRROR_RELATIVE   1
+#define OXT_KBD_MIRROR_ABSOLUTE   2
+
+struct oxtkbd_mirror_header {
+    uint32_t version;     /* OXT_KBD_MIRROR_VERSION */
+    uint32_t size;        /* the number of records in the ring; a power of two */
+    uint32_t prod;        /* the number of records written */
+    uint32_t reserved;
+};
+
+struct oxtkbd_mirror_event {
+    uint64_t time_ns;     /* the event's input timestamp (CLOCK_MONOTONIC) */
+    uint16_t device;      /* OXT_KBD_MIRROR_* */
+    uint16_t type;        /* as in struct input_event */
+    uint16_t code;
+    uint16_t reserved;
+    int32_t  value;
+    uint32_t reserved2;
+};
+
+#endif
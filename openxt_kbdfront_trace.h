@@ -0,0 +1,158 @@
+/*
+ * OpenXT para-virtual input device tracepoints
+ *
+ *  This file is subject to the terms and conditions of the GNU General Public
+ *  License. See the file COPYING in the main directory of this archive for
+ *  more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM openxt_kbdfront
+
+#if !defined(__OPENXT_KBDFRONT_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __OPENXT_KBDFRONT_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+/*
+ * Every event we handle fits in a compact ring slot, so the first
+ * OXT_KBD_TRACE_RECORD_SIZE bytes of each slot capture it completely,
+ * whichever ring format is in use. The raw field of each oxtkbd_ring_event,
+ * written out in order, can be loaded into <debugfs>/openxt-kbdfront/replay
+ * and replayed through the benchmark. Touch batches continue into the
+ * slots that follow them, so they're only captured completely on a
+ * compact ring.
+ */
+#define OXT_KBD_TRACE_RECORD_SIZE  OXT_KBD_COMPACT_EVENT_SIZE
+
+/*
+ * Our tracepoints take pointers to the ring's shared indices, rather than
+ * their values, so that the backend's cache line is only read when the
+ * tracepoint is enabled: arguments are evaluated regardless.
+ */
+
+/**
+ * An interrupt on one of our rings; gap is the number of events waiting.
+ */
+TRACE_EVENT(oxtkbd_interrupt,
+
+    TP_PROTO(unsigned int ring, const u32 *prod, const u32 *cons),
+
+    TP_ARGS(ring, prod, cons),
+
+    TP_STRUCT__entry(
+        __field(u32, prod)
+        __field(u32, cons)
+        __field(u8,  ring)
+    ),
+
+    TP_fast_assign(
+        __entry->prod = READ_ONCE(*prod);
+        __entry->cons = READ_ONCE(*cons);
+        __entry->ring = ring;
+    ),
+
+    TP_printk("ring=%u prod=%u cons=%u gap=%u",
+        __entry->ring, __entry->prod, __entry->cons,
+        __entry->prod - __entry->cons)
+);
+
+/**
+ * A raw event, as read from the ring; gap is the number of events behind
+ * it, including itself.
+ */
+TRACE_EVENT(oxtkbd_ring_event,
+
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 idx, const void *event),
+
+    TP_ARGS(ring, prod, idx, event),
+
+    TP_STRUCT__entry(
+        __field(u32, idx)
+        __field(u32, gap)
+        __field(u8,  ring)
+        __array(u8,  raw, OXT_KBD_TRACE_RECORD_SIZE)
+    ),
+
+    TP_fast_assign(
+        __entry->idx  = idx;
+        __entry->gap  = READ_ONCE(*prod) - idx;
+        __entry->ring = ring;
+        memcpy(__entry->raw, event, OXT_KBD_TRACE_RECORD_SIZE);
+    ),
+
+    TP_printk("ring=%u idx=%u gap=%u type=%u raw=%s",
+        __entry->ring, __entry->idx, __entry->gap, __entry->raw[0],
+        __print_hex(__entry->raw, OXT_KBD_TRACE_RECORD_SIZE))
+);
+
+/**
+ * An event, as decoded by one of our handlers; gap is the number of events
+ * behind it, including itself, counted from cursor, the ring index of the
+ * event being handled. The meaning of id, x and y depends on the event:
+ * see each of the events below.
+ */
+DECLARE_EVENT_CLASS(oxtkbd_input_event,
+
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 cursor, u8 type, s32 id, s32 x, s32 y),
+
+    TP_ARGS(ring, prod, cursor, type, id, x, y),
+
+    TP_STRUCT__entry(
+        __field(u32, gap)
+        __field(s32, id)
+        __field(s32, x)
+        __field(s32, y)
+        __field(u8,  ring)
+        __field(u8,  type)
+    ),
+
+    TP_fast_assign(
+        __entry->gap  = READ_ONCE(*prod) - cursor;
+        __entry->id   = id;
+        __entry->x    = x;
+        __entry->y    = y;
+        __entry->ring = ring;
+        __entry->type = type;
+    ),
+
+    TP_printk("ring=%u gap=%u type=%u id=%d x=%d y=%d",
+        __entry->ring, __entry->gap, __entry->type,
+        __entry->id, __entry->x, __entry->y)
+);
+
+//Relative motion: x and y are the motion, and id the scroll wheel motion.
+DEFINE_EVENT(oxtkbd_input_event, oxtkbd_handle_motion,
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 cursor, u8 type, s32 id, s32 x, s32 y),
+    TP_ARGS(ring, prod, cursor, type, id, x, y));
+
+//Absolute motion: x and y are the position, after any scaling, and id the
+//scroll wheel motion.
+DEFINE_EVENT(oxtkbd_input_event, oxtkbd_handle_position,
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 cursor, u8 type, s32 id, s32 x, s32 y),
+    TP_ARGS(ring, prod, cursor, type, id, x, y));
+
+//Keys and buttons: id is the keycode, and x is non-zero for a press.
+DEFINE_EVENT(oxtkbd_input_event, oxtkbd_handle_key,
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 cursor, u8 type, s32 id, s32 x, s32 y),
+    TP_ARGS(ring, prod, cursor, type, id, x, y));
+
+//Touch contacts: id is the backend's contact identifier, and x and y its
+//position, after any scaling. Packed movements and touch batches produce
+//one of these per contact.
+DEFINE_EVENT(oxtkbd_input_event, oxtkbd_handle_touch,
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 cursor, u8 type, s32 id, s32 x, s32 y),
+    TP_ARGS(ring, prod, cursor, type, id, x, y));
+
+//Touch frames carry no data.
+DEFINE_EVENT(oxtkbd_input_event, oxtkbd_handle_touch_frame,
+    TP_PROTO(unsigned int ring, const u32 *prod, u32 cursor, u8 type, s32 id, s32 x, s32 y),
+    TP_ARGS(ring, prod, cursor, type, id, x, y));
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE openxt_kbdfront_trace
+#include <trace/define_trace.h>
@@ -95,6 +95,124 @@ struct oxtkbd_touch_frame {
     uint8_t type;   /* OXT_KBD_TYPE_TOUCH_FRAME */
 };
 
+/*
+ * Compact ring format.
+ *
+ * Every in event above fits in 16 bytes, but occupies a full
+ * OXT_KBD_IN_EVENT_SIZE ring slot. Backends that advertise
+ * "feature-compact-events" accept a request (the frontend writing
+ * "request-compact-events") to use OXT_KBD_COMPACT_EVENT_SIZE byte slots
+ * instead, which fits two and a half times as many events into the ring.
+ *
+ * Ring indices are free-running 32-bit counters, reduced modulo the ring's
+ * length to find their slot, so only a power-of-two length keeps the mapping
+ * continuous when an index wraps. Every in ring format but the legacy one
+ * therefore has a power-of-two number of slots: a compact ring has
+ * OXT_KBD_COMPACT_IN_RING_LEN_ORDER(order) of them. Any space left over sits,
+ * unused, at the end of the in ring, just before the out ring.
+ *
+ * The compact format also adds a packed touch movement record, which
+ * carries up to OXT_KBD_PACKED_TOUCH_CONTACTS contacts using 16-bit
+ * coordinates. It should only be sent on a compact ring.
+ */
+#define OXT_KBD_COMPACT_EVENT_SIZE 16
+
+#define OXT_KBD_TYPE_TOUCH_MOVE_PACKED  9
+
+#define OXT_KBD_PACKED_TOUCH_CONTACTS   2
+
+/**
+ * A single contact within a packed touch movement record.
+ */
+struct oxtkbd_packed_contact {
+    uint8_t  id;        /* the finger identifier for this contact */
+    uint8_t  reserved;
+    uint16_t abs_x;     /* absolute X position (in FB pixels) */
+    uint16_t abs_y;     /* absolute Y position (in FB pixels) */
+};
+
+/**
+ * Packet describing the movement of several touch contacts at once.
+ * Equivalent to one OXT_KBD_TYPE_TOUCH_MOVE for each contact.
+ */
+struct oxtkbd_touch_move_packed {
+    uint8_t type;   /* OXT_KBD_TYPE_TOUCH_MOVE_PACKED */
+    uint8_t count;  /* the number of valid entries in contacts */
+    struct oxtkbd_packed_contact contacts[OXT_KBD_PACKED_TOUCH_CONTACTS];
+};
+
+/*
+ * Timestamps.
+ *
+ * Backends that advertise "feature-timestamps" accept a request (the
+ * frontend writing "request-timestamps") to precede each batch of events
+ * with a timestamp record, giving the time at which the batch's input
+ * physically occurred, in nanoseconds on a monotonic clock of the backend's
+ * choosing. The timestamp applies to every event that follows it on the
+ * ring, up until the next timestamp record.
+ *
+ * The backend's clock need not be related to the frontend's; frontends
+ * estimate the offset between the two from the records themselves.
+ */
+#define OXT_KBD_TYPE_TIMESTAMP  10
+
+/**
+ * Packet describing the time at which the following events occurred.
+ */
+struct oxtkbd_timestamp {
+    uint8_t  type;          /* OXT_KBD_TYPE_TIMESTAMP */
+    uint8_t  reserved[7];
+    uint64_t timestamp_ns;  /* backend time of the following events (in ns) */
+};
+
+/*
+ * Touch batches.
+ *
+ * Backends that advertise "feature-touch-batch" accept a request (the
+ * frontend writing "request-touch-batch") to describe a whole touch frame
+ * with a single batch record, rather than a touch event for each contact
+ * followed by a frame marker.
+ *
+ * A batch record gives the set of contacts touching as of the end of its
+ * frame, as a bitmap indexed by contact identifier, followed by the
+ * position of each of those contacts, in order of identifier. Contacts
+ * that were touching as of the previous batch, but aren't in this one,
+ * have been lifted. Each record ends a frame, exactly as a
+ * OXT_KBD_TYPE_TOUCH_FRAME would.
+ *
+ * Positions start OXT_KBD_TOUCH_BATCH_HEADER_SIZE bytes into the record's
+ * first slot, and continue into the slots that follow it, as though the
+ * slots were contiguous; so a record occupies
+ * OXT_KBD_TOUCH_BATCH_SLOTS(contacts, slot size) slots. The backend must
+ * publish all of a record's slots at once. Backends should not describe
+ * the same contacts with both batch records and individual touch events.
+ */
+#define OXT_KBD_TYPE_TOUCH_BATCH  11
+
+#define OXT_KBD_TOUCH_BATCH_HEADER_SIZE  8
+#define OXT_KBD_TOUCH_BATCH_MAX_CONTACTS 32
+
+/**
+ * Packet describing every contact of a touch frame at once.
+ */
+struct oxtkbd_touch_batch {
+    uint8_t  type;        /* OXT_KBD_TYPE_TOUCH_BATCH */
+    uint8_t  reserved[3];
+    uint32_t contacts;    /* bit n set iff contact n is touching */
+};
+
+/**
+ * The position of a single contact within a touch batch.
+ */
+struct oxtkbd_batch_position {
+    uint16_t abs_x;       /* absolute X position (in FB pixels) */
+    uint16_t abs_y;       /* absolute Y position (in FB pixels) */
+};
+
+#define OXT_KBD_TOUCH_BATCH_SLOTS(contacts, slot_size) \
+    ((OXT_KBD_TOUCH_BATCH_HEADER_SIZE + \
+      (contacts) * sizeof(struct oxtkbd_batch_position) + (slot_size) - 1) / (slot_size))
+
 #define OXT_KBD_IN_EVENT_SIZE 40
 
 /**
@@ -117,17 +235,197 @@ union oxtkbd_in_event {
     struct oxtkbd_touch_up     touch_up;
     struct oxtkbd_touch_frame  touch_frame;
 
+    //Compact ring format only:
+    struct oxtkbd_touch_move_packed touch_move_packed;
+
+    //Only if timestamps are negotiated:
+    struct oxtkbd_timestamp timestamp;
+
+    //Only if touch batches are negotiated:
+    struct oxtkbd_touch_batch touch_batch;
+
     char pad[OXT_KBD_IN_EVENT_SIZE];
 };
 
 /* shared page */
 
+/*
+ * Event indices.
+ *
+ * Backends that advertise "feature-event-index" accept a request (the
+ * frontend writing "request-event-index") to suppress unneeded event channel
+ * notifications, in the same manner as the req_event/rsp_event fields of the
+ * standard Xen shared rings. The indices live in the reserved space that
+ * follows the standard ring indices:
+ *
+ *  - The backend only notifies the frontend of new events when in_prod
+ *    passes in_prod_event. The frontend sets in_prod_event to one past the
+ *    last event it consumed before it stops consuming.
+ *
+ *  - The frontend only notifies the backend of consumed events when in_cons
+ *    passes in_cons_event. The backend sets in_cons_event when it's waiting
+ *    for space on a full ring.
+ *
+ * After setting an event index, each side must re-check the ring, as the
+ * other side may have moved past the new index before it was visible.
+ */
+struct oxtkbd_page {
+    uint32_t in_cons, in_prod;
+    uint32_t out_cons, out_prod;
+    uint32_t in_prod_event;
+    uint32_t in_cons_event;
+};
+
+/*
+ * Returns true iff moving an index from old to new passes the provided
+ * event index, and thus requires a notification.
+ */
+#define OXT_KBD_NEED_NOTIFY(new, old, event) \
+    ((uint32_t)((new) - (event)) < (uint32_t)((new) - (old)))
+
 #define OXT_KBD_IN_RING_SIZE 2048
-#define OXT_KBD_IN_RING_LEN (XENKBD_IN_RING_SIZE / XENKBD_IN_EVENT_SIZE)
+#define OXT_KBD_IN_RING_LEN (OXT_KBD_IN_RING_SIZE / OXT_KBD_IN_EVENT_SIZE)
 #define OXT_KBD_IN_RING_OFFS 1024
 #define OXT_KBD_IN_RING(page) \
     ((union oxtkbd_in_event *)((char *)(page) + OXT_KBD_IN_RING_OFFS))
 #define OXT_KBD_IN_RING_REF(page, idx) \
-    (OXT_KBD_IN_RING((page))[(idx) % XENKBD_IN_RING_LEN])
+    (OXT_KBD_IN_RING((page))[(idx) % OXT_KBD_IN_RING_LEN])
+
+/*
+ * Multi-page rings.
+ *
+ * Backends that can map a ring larger than a single page advertise the
+ * largest ring they can accept by writing "max-ring-page-order" to their
+ * xenstore directory. Frontends wishing to use a larger ring then write
+ * "ring-page-order", and a "page-gref%u" for each of the 2^order pages.
+ *
+ * A multi-page ring area keeps the layout of the single shared page:
+ * the ring indices come first, the in ring starts at OXT_KBD_IN_RING_OFFS,
+ * and the final OXT_KBD_OUT_RING_SIZE bytes are reserved for the out ring.
+ * For an order of zero, this is exactly the legacy layout. For any larger
+ * order, the in ring has OXT_KBD_IN_RING_LEN_ORDER(order) slots, a power of
+ * two, so its indices wrap cleanly; whatever space that leaves between the
+ * in ring and the out ring is unused.
+ */
+#define OXT_KBD_RING_PAGE_SIZE        4096
+#define OXT_KBD_MAX_RING_PAGE_ORDER   4
+#define OXT_KBD_MAX_RING_PAGES        (1 << OXT_KBD_MAX_RING_PAGE_ORDER)
+
+#define OXT_KBD_OUT_RING_SIZE 1024
+#define OXT_KBD_RING_AREA_SIZE(order) \
+    (OXT_KBD_RING_PAGE_SIZE << (order))
+#define OXT_KBD_IN_RING_SIZE_ORDER(order) \
+    (OXT_KBD_RING_AREA_SIZE(order) - OXT_KBD_IN_RING_OFFS - OXT_KBD_OUT_RING_SIZE)
+#define OXT_KBD_IN_RING_LEN_ORDER(order) \
+    ((order) ? 64U << (order) : OXT_KBD_IN_RING_LEN)
+#define OXT_KBD_COMPACT_IN_RING_LEN_ORDER(order) \
+    ((OXT_KBD_IN_RING_SIZE / OXT_KBD_COMPACT_EVENT_SIZE) << (order))
+
+/*
+ * Shared ring pages.
+ *
+ * Backends that can find a ring area part-way into a granted page advertise
+ * "feature-ring-offset". A frontend driving many devices may then place the
+ * ring areas of several devices that share a backend in a single page: each
+ * such area is OXT_KBD_SHARED_AREA_SIZE bytes, aligned to its size, and the
+ * frontend writes its byte offset within the granted page as "ring-offset".
+ * Shared areas always fit within a single page, so "ring-offset" is never
+ * combined with "ring-page-order".
+ *
+ * A shared area keeps the ring indices at its start, but is laid out more
+ * tightly than a full page: its in ring starts at OXT_KBD_SHARED_IN_RING_OFFS,
+ * and its final OXT_KBD_SHARED_OUT_RING_SIZE bytes are its out ring. As this
+ * layout is new, both of its rings have a power-of-two number of slots: its
+ * in ring has OXT_KBD_SHARED_IN_RING_LEN, or OXT_KBD_SHARED_COMPACT_IN_RING_LEN
+ * in the compact format, and its out ring OXT_KBD_SHARED_OUT_RING_LEN.
+ */
+#define OXT_KBD_SHARED_AREA_SIZE      2048
+#define OXT_KBD_SHARED_IN_RING_OFFS   64
+#define OXT_KBD_SHARED_OUT_RING_LEN   8
+#define OXT_KBD_SHARED_OUT_RING_SIZE  (OXT_KBD_SHARED_OUT_RING_LEN * OXT_KBD_OUT_EVENT_SIZE)
+#define OXT_KBD_SHARED_IN_RING_SIZE \
+    (OXT_KBD_SHARED_AREA_SIZE - OXT_KBD_SHARED_IN_RING_OFFS - OXT_KBD_SHARED_OUT_RING_SIZE)
+#define OXT_KBD_SHARED_IN_RING_LEN          32
+#define OXT_KBD_SHARED_COMPACT_IN_RING_LEN  64
+
+/*
+ * Multiple rings.
+ *
+ * Backends that can deliver events over more than one ring advertise the
+ * number of rings they can drive by writing "max-rings". Frontends wishing
+ * to use more than one ring then write "rings". Each ring has its own ring
+ * area, of the negotiated order and format, and its own event channel. Ring
+ * zero uses the legacy keys ("page-ref", "page-gref", "page-gref%u" and
+ * "event-channel", plus "ring-offset" if its area is shared); each further
+ * ring uses the same keys, less "page-ref", beneath a "ring%u/" subdirectory.
+ *
+ * With two rings, ring OXT_KBD_KEY_RING carries only keyboard key events,
+ * and ring OXT_KBD_POINTER_RING carries everything else-- including
+ * pointer buttons, which must stay ordered against pointer motion. Either
+ * ring may also carry timestamps, which apply only to the ring that
+ * carries them.
+ */
+#define OXT_KBD_MAX_RINGS     2
+#define OXT_KBD_KEY_RING      0
+#define OXT_KBD_POINTER_RING  1
+
+/*
+ * Output events.
+ *
+ * Backends that can act on output-- keyboard LEDs, and force feedback--
+ * advertise "feature-output-events". Frontends wishing to send output then
+ * write "request-output-events", and produce output events into the out
+ * ring of ring zero: the final OXT_KBD_OUT_RING_SIZE bytes of its ring area,
+ * divided into OXT_KBD_OUT_RING_LEN slots of OXT_KBD_OUT_EVENT_SIZE bytes.
+ * For an order of zero, this is exactly where the legacy layout puts it.
+ *
+ * The frontend advances out_prod, and the backend out_cons, in the same
+ * manner as the in ring's indices, but with the roles reversed. The frontend
+ * writes events in batches, and notifies ring zero's event channel once per
+ * batch; the backend should check its out ring on every notification.
+ *
+ * Each output event carries the complete state it describes, rather than a
+ * change to it, so a backend that falls behind need only act on the latest
+ * event of each type. If the out ring is full, the frontend waits for space
+ * rather than overwriting events, and sends its latest state once there is.
+ * Backends should quietly ignore any event type they don't understand.
+ */
+#define OXT_KBD_OUT_EVENT_SIZE 40
+#define OXT_KBD_OUT_RING_LEN (OXT_KBD_OUT_RING_SIZE / OXT_KBD_OUT_EVENT_SIZE)
+#define OXT_KBD_OUT_RING_OFFS_ORDER(order) \
+    (OXT_KBD_RING_AREA_SIZE(order) - OXT_KBD_OUT_RING_SIZE)
+
+/*
+ * The state of the keyboard's LEDs: bit n of leds is set iff the LED with
+ * Linux LED code n (e.g. LED_CAPSL) is lit.
+ */
+#define OXT_KBD_OUT_TYPE_LED     1
+
+struct oxtkbd_out_led {
+    uint8_t  type;        /* OXT_KBD_OUT_TYPE_LED */
+    uint8_t  reserved[3];
+    uint32_t leds;
+};
+
+/*
+ * The rumble effect the absolute pointer should be playing, with magnitudes
+ * from 0 to 0xffff for its strong (low frequency) and weak (high frequency)
+ * motors. Both magnitudes are zero once nothing is playing.
+ */
+#define OXT_KBD_OUT_TYPE_RUMBLE  2
+
+struct oxtkbd_out_rumble {
+    uint8_t  type;        /* OXT_KBD_OUT_TYPE_RUMBLE */
+    uint8_t  reserved;
+    uint16_t strong;
+    uint16_t weak;
+};
+
+union oxtkbd_out_event {
+    uint8_t type;
+    struct oxtkbd_out_led    led;
+    struct oxtkbd_out_rumble rumble;
+    char pad[OXT_KBD_OUT_EVENT_SIZE];
+};
 
 #endif